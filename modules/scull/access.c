@@ -25,9 +25,11 @@
 #include <linux/types.h>  /* size_t */
 #include <linux/fcntl.h>
 #include <linux/cdev.h>
+#include <linux/xarray.h>
 #include <linux/tty.h>
 #include <asm/atomic.h>
 #include <linux/list.h>
+#include <linux/mutex.h>
 #include <linux/cred.h> /* current_uid(), current_euid() */
 #include <linux/sched.h>
 #include <linux/sched/signal.h>
@@ -62,8 +64,11 @@ static int scull_s_open(struct inode *inode, struct file *filp)
 	}
 
 	/* then, everything else is copied from the bare scull device */
-	if ( (filp->f_flags & O_ACCMODE) == O_WRONLY)
+	if ( (filp->f_flags & O_ACCMODE) == O_WRONLY) {
+		down_write(&dev->sem);
 		scull_trim(dev);
+		up_write(&dev->sem);
+	}
 	filp->private_data = dev;
 	return 0;          /* success */
 }
@@ -81,8 +86,11 @@ static int scull_s_release(struct inode *inode, struct file *filp)
 struct file_operations scull_sngl_fops = {
 	.owner =	THIS_MODULE,
 	.llseek =     	scull_llseek,
-	.read =       	scull_read,
-	.write =      	scull_write,
+	.read_iter = scull_read_iter,
+	.write_iter = scull_write_iter,
+	.splice_read = scull_splice_read,
+	.splice_write = iter_file_splice_write,
+	.mmap = scull_mmap,
 	.unlocked_ioctl = scull_ioctl,
 	.open =       	scull_s_open,
 	.release =    	scull_s_release,
@@ -121,8 +129,11 @@ static int scull_u_open(struct inode *inode, struct file *filp)
 
 /* then, everything else is copied from the bare scull device */
 
-	if ((filp->f_flags & O_ACCMODE) == O_WRONLY)
+	if ((filp->f_flags & O_ACCMODE) == O_WRONLY) {
+		down_write(&dev->sem);
 		scull_trim(dev);
+		up_write(&dev->sem);
+	}
 	filp->private_data = dev;
 	return 0;          /* success */
 }
@@ -143,8 +154,11 @@ static int scull_u_release(struct inode *inode, struct file *filp)
 struct file_operations scull_user_fops = {
 	.owner =      THIS_MODULE,
 	.llseek =     scull_llseek,
-	.read =       scull_read,
-	.write =      scull_write,
+	.read_iter = scull_read_iter,
+	.write_iter = scull_write_iter,
+	.splice_read = scull_splice_read,
+	.splice_write = iter_file_splice_write,
+	.mmap = scull_mmap,
 	.unlocked_ioctl = scull_ioctl,
 	.open =       scull_u_open,
 	.release =    scull_u_release,
@@ -189,8 +203,11 @@ static int scull_w_open(struct inode *inode, struct file *filp)
 	spin_unlock(&scull_w_lock);
 
 	/* then, everything else is copied from the bare scull device */
-	if ((filp->f_flags & O_ACCMODE) == O_WRONLY)
+	if ((filp->f_flags & O_ACCMODE) == O_WRONLY) {
+		down_write(&dev->sem);
 		scull_trim(dev);
+		up_write(&dev->sem);
+	}
 	filp->private_data = dev;
 	return 0;          /* success */
 }
@@ -216,8 +233,11 @@ static int scull_w_release(struct inode *inode, struct file *filp)
 struct file_operations scull_wusr_fops = {
 	.owner =      THIS_MODULE,
 	.llseek =     scull_llseek,
-	.read =       scull_read,
-	.write =      scull_write,
+	.read_iter = scull_read_iter,
+	.write_iter = scull_write_iter,
+	.splice_read = scull_splice_read,
+	.splice_write = iter_file_splice_write,
+	.mmap = scull_mmap,
 	.unlocked_ioctl = scull_ioctl,
 	.open =       scull_w_open,
 	.release =    scull_w_release,
@@ -238,9 +258,12 @@ struct scull_listitem {
     
 };
 
-/* The list of devices, and a lock to protect it */
+/*
+ * The list of devices, and a lock to protect it: a mutex, as new
+ * devices are set up with it held, which sleeps.
+ */
 static LIST_HEAD(scull_c_list);
-static DEFINE_SPINLOCK(scull_c_lock);
+static DEFINE_MUTEX(scull_c_lock);
 
 /* A placeholder scull_dev which really just holds the cdev stuff. */
 static struct scull_dev scull_c_device;   
@@ -249,6 +272,7 @@ static struct scull_dev scull_c_device;
 static struct scull_dev *scull_c_lookfor_device(dev_t key)
 {
 	struct scull_listitem *lptr;
+	char name[24];
 
 	list_for_each_entry(lptr, &scull_c_list, list) {
 		if (lptr->key == key)
@@ -263,11 +287,15 @@ static struct scull_dev *scull_c_lookfor_device(dev_t key)
 	/* initialize the device */
 	memset(lptr, 0, sizeof(struct scull_listitem));
 	lptr->key = key;
-	scull_trim(&(lptr->device)); /* initialize it */
-	mutex_init(&lptr->device.lock);
+	if (scull_dev_init(&(lptr->device))) { /* initialize it */
+		kfree(lptr);
+		return NULL;
+	}
 
 	/* place it in the list */
 	list_add(&lptr->list, &scull_c_list);
+	snprintf(name, sizeof(name), "scullpriv.%x", key);
+	scull_debugfs_add(&lptr->device, name);
 
 	return &(lptr->device);
 }
@@ -284,16 +312,20 @@ static int scull_c_open(struct inode *inode, struct file *filp)
 	key = tty_devnum(current->signal->tty);
 
 	/* look for a scullc device in the list */
-	spin_lock(&scull_c_lock);
+	if (mutex_lock_interruptible(&scull_c_lock))
+		return -ERESTARTSYS;
 	dev = scull_c_lookfor_device(key);
-	spin_unlock(&scull_c_lock);
+	mutex_unlock(&scull_c_lock);
 
 	if (!dev)
 		return -ENOMEM;
 
 	/* then, everything else is copied from the bare scull device */
-	if ( (filp->f_flags & O_ACCMODE) == O_WRONLY)
+	if ( (filp->f_flags & O_ACCMODE) == O_WRONLY) {
+		down_write(&dev->sem);
 		scull_trim(dev);
+		up_write(&dev->sem);
+	}
 	filp->private_data = dev;
 	return 0;          /* success */
 }
@@ -315,8 +347,11 @@ static int scull_c_release(struct inode *inode, struct file *filp)
 struct file_operations scull_priv_fops = {
 	.owner =    THIS_MODULE,
 	.llseek =   scull_llseek,
-	.read =     scull_read,
-	.write =    scull_write,
+	.read_iter = scull_read_iter,
+	.write_iter = scull_write_iter,
+	.splice_read = scull_splice_read,
+	.splice_write = iter_file_splice_write,
+	.mmap = scull_mmap,
 	.unlocked_ioctl = scull_ioctl,
 	.open =     scull_c_open,
 	.release =  scull_c_release,
@@ -340,7 +375,8 @@ static struct scull_adev_info {
 #define SCULL_N_ADEVS 4
 
 /*
- * Set up a single device.
+ * Set up a single device. One that fails is left with no cdev ops, so
+ * that the cleanup knows there is no cdev to delete.
  */
 static void scull_access_setup (dev_t devno, struct scull_adev_info *devinfo)
 {
@@ -348,9 +384,12 @@ static void scull_access_setup (dev_t devno, struct scull_adev_info *devinfo)
 	int err;
 
 	/* Initialize the device structure */
-	dev->quantum = scull_quantum;
-	dev->qset = scull_qset;
-	mutex_init(&dev->lock);
+	err = scull_dev_init(dev);
+	if (err) {
+		printk(KERN_NOTICE "Error %d initializing %s\n", err,
+				devinfo->name);
+		return;
+	}
 
 	/* Do the cdev stuff. */
 	cdev_init(&dev->cdev, devinfo->fops);
@@ -361,8 +400,13 @@ static void scull_access_setup (dev_t devno, struct scull_adev_info *devinfo)
 	if (err) {
 		printk(KERN_NOTICE "Error %d adding %s\n", err, devinfo->name);
 		kobject_put(&dev->cdev.kobj);
+		dev->cdev.ops = NULL;
 	} else
 		printk(KERN_NOTICE "%s registered at %x\n", devinfo->name, devno);
+
+	/* the scullpriv one only stands for the clones, which get their own */
+	if (dev != &scull_c_device)
+		scull_debugfs_add(dev, devinfo->name);
 }
 
 
@@ -396,14 +440,15 @@ void scull_access_cleanup(void)
 	/* Clean up the static devs */
 	for (i = 0; i < SCULL_N_ADEVS; i++) {
 		struct scull_dev *dev = scull_access_devs[i].sculldev;
-		cdev_del(&dev->cdev);
-		scull_trim(scull_access_devs[i].sculldev);
+		if (dev->cdev.ops)
+			cdev_del(&dev->cdev);
+		scull_dev_cleanup(dev);
 	}
 
     	/* And all the cloned devices */
 	list_for_each_entry_safe(lptr, next, &scull_c_list, list) {
 		list_del(&lptr->list);
-		scull_trim(&(lptr->device));
+		scull_dev_cleanup(&(lptr->device));
 		kfree(lptr);
 	}
 
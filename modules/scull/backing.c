@@ -0,0 +1,430 @@
+/*
+ * backing.c -- saving scull devices to files, and loading them back
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+
+#include <linux/kernel.h>	/* printk() */
+#include <linux/slab.h>		/* kmalloc() */
+#include <linux/mm.h>		/* kvmalloc() */
+#include <linux/fs.h>		/* everything... */
+#include <linux/errno.h>	/* error codes */
+#include <linux/types.h>
+#include <linux/fcntl.h>	/* O_RDONLY */
+#include <linux/file.h>		/* fdget() */
+#include <linux/cdev.h>
+#include <linux/uio.h>		/* struct iov_iter */
+#include <linux/string.h>	/* memchr_inv() */
+#include <linux/sched/signal.h>	/* fatal_signal_pending() */
+#include <linux/workqueue.h>
+#include <linux/namei.h>	/* lock_rename(), lookup_one_len() */
+#include <linux/bitmap.h>
+
+#include "scull.h"		/* local definitions */
+
+/*
+ * An image is a header, then the data of the device at its offset plus
+ * SCULL_IMAGE_DATA. Holes (and quanta of zeroes) are not written, so
+ * that the file has holes of its own where the device has; loading
+ * looks for the data with SEEK_DATA, and skips what reads as zeroes on
+ * filesystems without holes. Data moves in chunks of SCULL_B_CHUNK.
+ *
+ * With scull_backing=<dir>, the bare devices are loaded from
+ * <dir>/scull0, ... at load time and saved there on unload, all of
+ * them at once. A save goes to <dir>/scullN.tmp first, which then
+ * replaces scullN, so that a failed one leaves the last image alone.
+ * SCULL_IOCSAVE and SCULL_IOCLOAD do one device at any time; they
+ * write over the file they are given, so the caller does the same
+ * dance if the old image matters. Saving a device that is being
+ * written gives a mix of old and new, so save a snapshot
+ * (SCULL_IOCSNAP) of it instead.
+ */
+#define SCULL_B_CHUNK (1 << 20)
+
+static char *scull_backing;
+module_param(scull_backing, charp, S_IRUGO);
+
+/*
+ * A device is only saved at unload if its image was loaded at load
+ * time, or there was none: one that failed to load would otherwise
+ * have a good image replaced by what little got in.
+ */
+static unsigned long *scull_b_armed;
+
+static ssize_t scull_b_read(struct scull_dev *dev, void *buf, size_t len,
+		loff_t pos)
+{
+	struct kiocb kiocb = { .ki_pos = pos };
+	struct kvec kv = { .iov_base = buf, .iov_len = len };
+	struct iov_iter iter;
+
+	iov_iter_kvec(&iter, READ, &kv, 1, len);
+	return scull_read_dev(dev, &kiocb, &iter);
+}
+
+static int scull_b_write(struct scull_dev *dev, void *buf, size_t len,
+		loff_t pos)
+{
+	struct kiocb kiocb = { .ki_pos = pos };
+	struct kvec kv = { .iov_base = buf, .iov_len = len };
+	struct iov_iter iter;
+	ssize_t n;
+
+	iov_iter_kvec(&iter, WRITE, &kv, 1, len);
+	while (iov_iter_count(&iter)) {
+		n = scull_write_dev(dev, &kiocb, &iter);
+		if (n <= 0)
+			return n ? n : -EIO;
+	}
+	return 0;
+}
+
+/* kernel_write() to a file may stop short, like write() */
+static int scull_b_store(struct file *out, void *buf, size_t len, loff_t *off)
+{
+	ssize_t n;
+
+	while (len) {
+		n = kernel_write(out, buf, len, off);
+		if (n <= 0)
+			return n ? n : -EIO;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Save "dev" to "out", a regular file open for writing; whatever the
+ * file held is dropped. The header goes last, so that an image cut
+ * short is not taken for a good one. O_APPEND would put everything at
+ * the end, whatever the offset.
+ */
+int scull_b_save(struct scull_dev *dev, struct file *out)
+{
+	struct scull_image img;
+	loff_t pos = 0, end, off;
+	ssize_t n;
+	char *buf;
+	int retval;
+
+	if (!S_ISREG(file_inode(out)->i_mode) || (out->f_flags & O_APPEND))
+		return -EINVAL;
+	retval = vfs_truncate(&out->f_path, 0);
+	if (retval)
+		return retval;
+	buf = kvmalloc(SCULL_B_CHUNK, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	/* from one run of data to the next */
+	for (;;) {
+		retval = -ERESTARTSYS;
+		if (down_read_killable(&dev->sem))
+			goto out;
+		pos = scull_seek_hole_data(dev, pos, SEEK_DATA);
+		end = pos < 0 ? pos : scull_seek_hole_data(dev, pos, SEEK_HOLE);
+		up_read(&dev->sem);
+		if (pos < 0)
+			break;
+
+		while (pos < end) {
+			n = scull_b_read(dev, buf,
+					min_t(loff_t, end - pos, SCULL_B_CHUNK), pos);
+			retval = n;
+			if (n < 0)
+				goto out;
+			if (!n)	/* trimmed meanwhile */
+				break;
+			off = SCULL_IMAGE_DATA + pos;
+			if (memchr_inv(buf, 0, n)) {
+				retval = scull_b_store(out, buf, n, &off);
+				if (retval)
+					goto out;
+			}
+			pos += n;
+			retval = -EINTR;
+			if (fatal_signal_pending(current))
+				goto out;
+			cond_resched();
+		}
+	}
+
+	memset(&img, 0, sizeof(img));
+	img.magic = cpu_to_le32(SCULL_IMAGE_MAGIC);
+	img.version = cpu_to_le32(SCULL_IMAGE_VERSION);
+	img.size = cpu_to_le64(READ_ONCE(dev->size));
+	off = 0;
+	retval = scull_b_store(out, &img, sizeof(img), &off);
+
+  out:
+	kvfree(buf);
+	return retval;
+}
+
+/*
+ * Replace the contents of "dev" with the image in "in". The file
+ * position of "in" is used to look for data, and left anywhere.
+ */
+int scull_b_load(struct scull_dev *dev, struct file *in)
+{
+	struct scull_image img;
+	loff_t off = 0, data, hole, end;
+	char zero = 0;
+	u64 size;
+	ssize_t n;
+	char *buf;
+	int retval;
+
+	n = kernel_read(in, &img, sizeof(img), &off);
+	if (n < 0)
+		return n;
+	if (n != sizeof(img) || le32_to_cpu(img.magic) != SCULL_IMAGE_MAGIC ||
+			le32_to_cpu(img.version) != SCULL_IMAGE_VERSION)
+		return -EINVAL;
+	size = le64_to_cpu(img.size);
+	if (size > ULONG_MAX || size > LLONG_MAX - SCULL_IMAGE_DATA)
+		return -EFBIG;
+
+	buf = kvmalloc(SCULL_B_CHUNK, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	retval = -ERESTARTSYS;
+	if (down_write_killable(&dev->sem))
+		goto out;
+	retval = scull_trim(dev);
+	up_write(&dev->sem);
+	if (retval)
+		goto out;
+
+	end = SCULL_IMAGE_DATA + size;
+	for (off = SCULL_IMAGE_DATA; off < end; off = hole) {
+		data = vfs_llseek(in, off, SEEK_DATA);
+		if (data == -ENXIO || data >= end)
+			break;
+		retval = data;
+		if (data < 0)
+			goto out;
+		hole = vfs_llseek(in, data, SEEK_HOLE);
+		retval = hole;
+		if (hole < 0)
+			goto out;
+		hole = min(hole, end);
+
+		for (off = data; off < hole; ) {
+			n = kernel_read(in, buf,
+					min_t(loff_t, hole - off, SCULL_B_CHUNK), &off);
+			retval = n ? n : -EIO; /* the file shrank */
+			if (n <= 0)
+				goto out;
+			if (memchr_inv(buf, 0, n)) {
+				retval = scull_b_write(dev, buf, n,
+						off - n - SCULL_IMAGE_DATA);
+				if (retval)
+					goto out;
+			}
+			retval = -EINTR;
+			if (fatal_signal_pending(current))
+				goto out;
+			cond_resched();
+		}
+	}
+
+	/* a hole at the end: writing its last byte makes it all count */
+	retval = 0;
+	if (READ_ONCE(dev->size) < size)
+		retval = scull_b_write(dev, &zero, 1, size - 1);
+
+  out:
+	kvfree(buf);
+	return retval;
+}
+
+/*
+ * SCULL_IOCSAVE and SCULL_IOCLOAD, given the descriptor of the file;
+ * the caller checked the device was open the right way.
+ */
+int scull_b_ioctl(struct scull_dev *dev, unsigned int cmd, int fd)
+{
+	struct fd f = fdget(fd);
+	int retval;
+
+	if (!f.file)
+		return -EBADF;
+	if (cmd == SCULL_IOCSAVE) {
+		retval = -EBADF;
+		if (f.file->f_mode & FMODE_WRITE)
+			retval = scull_b_save(dev, f.file);
+	} else {
+		retval = -EBADF;
+		if (f.file->f_mode & FMODE_READ)
+			retval = scull_b_load(dev, f.file);
+	}
+	fdput(f);
+	return retval;
+}
+
+/*
+ * The devices are saved and loaded concurrently, one work item each.
+ */
+struct scull_b_job {
+	struct work_struct work;
+	struct scull_dev *dev;
+	int index;
+	int save;
+	int retval;
+};
+
+/*
+ * Give "file" the name "name" in its directory, replacing whatever had
+ * it; the file itself stays open.
+ */
+static int scull_b_rename(struct file *file, const char *name)
+{
+	struct dentry *old = file->f_path.dentry, *dir, *new;
+	struct inode *idir;
+	int retval;
+
+	dir = dget_parent(old);
+	idir = d_inode(dir);
+	lock_rename(dir, dir);
+	retval = -ENOENT;
+	if (old->d_parent != dir) /* moved meanwhile */
+		goto out;
+	new = lookup_one_len(name, dir, strlen(name));
+	retval = PTR_ERR(new);
+	if (IS_ERR(new))
+		goto out;
+	{
+		struct renamedata rd = {
+			.old_mnt_userns = &init_user_ns,
+			.new_mnt_userns = &init_user_ns,
+			.old_dir = idir,
+			.old_dentry = old,
+			.new_dir = idir,
+			.new_dentry = new,
+		};
+
+		retval = vfs_rename(&rd);
+	}
+	dput(new);
+  out:
+	unlock_rename(dir, dir);
+	dput(dir);
+	return retval;
+}
+
+static void scull_b_work(struct work_struct *work)
+{
+	struct scull_b_job *job = container_of(work, struct scull_b_job, work);
+	struct file *file;
+	char *path, *name;
+
+	/* saves go to a file of their own, renamed once complete */
+	path = kasprintf(GFP_KERNEL, "%s/scull%d%s", scull_backing, job->index,
+			job->save ? ".tmp" : "");
+	if (!path) {
+		job->retval = -ENOMEM;
+		return;
+	}
+	if (job->save)
+		file = filp_open(path, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE,
+				0600);
+	else
+		file = filp_open(path, O_RDONLY | O_LARGEFILE, 0);
+	kfree(path);
+	if (IS_ERR(file)) {
+		job->retval = PTR_ERR(file);
+		return;
+	}
+	if (!job->save) {
+		job->retval = scull_b_load(job->dev, file);
+		filp_close(file, NULL);
+		return;
+	}
+
+	/* a failed save leaves scullN.tmp behind, for the next one */
+	job->retval = scull_b_save(job->dev, file);
+	if (!job->retval)
+		job->retval = vfs_fsync(file, 0);
+	if (!job->retval) {
+		name = kasprintf(GFP_KERNEL, "scull%d", job->index);
+		job->retval = name ? scull_b_rename(file, name) : -ENOMEM;
+		kfree(name);
+	}
+	filp_close(file, NULL);
+}
+
+static void scull_b_all(struct scull_dev *devs, int nr, int save)
+{
+	struct scull_b_job *jobs;
+	int i;
+
+	jobs = kcalloc(nr, sizeof(*jobs), GFP_KERNEL);
+	if (!jobs) {
+		printk(KERN_WARNING "scull: no memory to %s the devices\n",
+				save ? "save" : "load");
+		return;
+	}
+	for (i = 0; i < nr; i++) {
+		if (save && !test_bit(i, scull_b_armed))
+			continue;
+		INIT_WORK(&jobs[i].work, scull_b_work);
+		jobs[i].dev = devs + i;
+		jobs[i].index = i;
+		jobs[i].save = save;
+		queue_work(system_unbound_wq, &jobs[i].work);
+	}
+	for (i = 0; i < nr; i++) {
+		if (!jobs[i].dev)	/* not queued */
+			continue;
+		flush_work(&jobs[i].work);
+		/* a device never saved is no error */
+		if (!jobs[i].retval || (!save && jobs[i].retval == -ENOENT)) {
+			if (!save)
+				set_bit(i, scull_b_armed);
+			continue;
+		}
+		printk(KERN_WARNING "scull%d: %s %s/scull%d failed, error %d%s\n",
+				i, save ? "saving to" : "loading from",
+				scull_backing, i, jobs[i].retval,
+				save ? "" : ", not saving it at unload");
+	}
+	kfree(jobs);
+}
+
+/* At load time, before the devices go live */
+void scull_b_load_all(struct scull_dev *devs, int nr)
+{
+	if (!scull_backing)
+		return;
+	scull_b_armed = bitmap_zalloc(nr, GFP_KERNEL);
+	if (!scull_b_armed) {
+		printk(KERN_WARNING "scull: no memory to load the devices\n");
+		return;
+	}
+	scull_b_all(devs, nr, 0);
+}
+
+/* At unload time, once nobody has the devices open */
+void scull_b_save_all(struct scull_dev *devs, int nr)
+{
+	if (!scull_backing || !scull_b_armed)
+		return;
+	scull_b_all(devs, nr, 1);
+	bitmap_free(scull_b_armed);
+	scull_b_armed = NULL;
+}
@@ -0,0 +1,294 @@
+/*
+ * compress.c -- keeping cold scull data compressed
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+
+#include <linux/kernel.h>	/* printk() */
+#include <linux/slab.h>		/* kmalloc() */
+#include <linux/mm.h>		/* kvmalloc() */
+#include <linux/fs.h>		/* everything... */
+#include <linux/errno.h>	/* error codes */
+#include <linux/types.h>
+#include <linux/cdev.h>
+#include <linux/xarray.h>
+#include <linux/mutex.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
+#include <linux/percpu.h>
+#include <linux/smp.h>		/* raw_smp_processor_id() */
+#include <linux/crypto.h>	/* crypto_comp_*() */
+
+#include "scull.h"		/* local definitions */
+
+/*
+ * Compression is off unless asked for: per device with SCULL_IOCTZIP,
+ * or for all the bare devices at load time with scull_zip_after (in
+ * seconds). Any compressor the crypto API knows will do; lz4 is cheap,
+ * zstd packs tighter.
+ */
+int scull_zip_after = 0;
+static char *scull_zip_alg = "lz4";
+
+module_param(scull_zip_after, int, S_IRUGO);
+module_param(scull_zip_alg, charp, S_IRUGO);
+
+/*
+ * A transform per CPU, shared by all the devices and allocated when
+ * compression is first turned on. Each keeps scratch state of its own,
+ * so it is used by one caller at a time; callers take the one of the
+ * CPU they run on, and only wait for another task that got it there
+ * first. They may sleep while they have it (zstd does).
+ */
+struct scull_z_stream {
+	struct crypto_comp *tfm;
+	struct mutex lock;
+};
+
+static struct scull_z_stream __percpu *scull_z_streams;
+static DEFINE_MUTEX(scull_z_mutex);	/* setting them up */
+
+static struct scull_z_stream *scull_z_get(void)
+{
+	struct scull_z_stream *zs;
+
+	/* set before any quantum could be packed, and never changed */
+	zs = per_cpu_ptr(READ_ONCE(scull_z_streams), raw_smp_processor_id());
+	mutex_lock(&zs->lock);
+	return zs;
+}
+
+static void scull_z_put(struct scull_z_stream *zs)
+{
+	mutex_unlock(&zs->lock);
+}
+
+static void scull_z_free(struct scull_z_stream __percpu *streams)
+{
+	struct scull_z_stream *zs;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		zs = per_cpu_ptr(streams, cpu);
+		if (zs->tfm)
+			crypto_free_comp(zs->tfm);
+	}
+	free_percpu(streams);
+}
+
+/* Called with scull_z_mutex held */
+static int scull_z_alloc(void)
+{
+	struct scull_z_stream __percpu *streams;
+	struct scull_z_stream *zs;
+	struct crypto_comp *tfm;
+	int cpu;
+
+	streams = alloc_percpu(struct scull_z_stream);
+	if (!streams)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		tfm = crypto_alloc_comp(scull_zip_alg, 0, 0);
+		if (IS_ERR(tfm)) {
+			scull_z_free(streams);
+			return PTR_ERR(tfm);
+		}
+		zs = per_cpu_ptr(streams, cpu);
+		zs->tfm = tfm;
+		mutex_init(&zs->lock);
+	}
+	WRITE_ONCE(scull_z_streams, streams);
+	return 0;
+}
+
+/*
+ * Compress the quantum at "slot", using "buf" (one quantum long) as
+ * scratch space. Called with the qset semaphore held for writing. The
+ * quantum is left alone if packing does not save an eighth of it.
+ */
+static void scull_z_pack(struct scull_dev *dev, void **slot, char *buf)
+{
+	struct scull_z_stream *zs = scull_z_get();
+	struct scull_packed *zq;
+	unsigned int len = dev->quantum;
+	u64 start = ktime_get_ns();	/* once we have the transform */
+	int err;
+
+	err = crypto_comp_compress(zs->tfm, *slot, dev->quantum, buf, &len);
+	atomic64_add(ktime_get_ns() - start, &dev->zip.nsecs);
+	scull_z_put(zs);
+
+	if (err || sizeof(*zq) + len > dev->quantum - dev->quantum / 8)
+		return;
+	zq = kmalloc(sizeof(*zq) + len, GFP_KERNEL);
+	if (!zq)
+		return;
+	zq->len = len;
+	memcpy(zq->data, buf, len);
+	scull_release_quantum(*slot, dev->quantum);
+	*slot = (void *)((unsigned long)zq | SCULL_PACKED);
+	atomic_long_inc(&dev->zip.quanta);
+	atomic_long_add(len, &dev->zip.packed);
+}
+
+/*
+ * The periodic scan. A qset nobody read or wrote for zip.after jiffies
+ * gets its plain quanta packed; shared ones are left alone, as others
+ * may be reading them. The device semaphore is only held for one qset
+ * at a time, so that a trim waiting for it does not hold up the
+ * readers queued behind it; qsets busy with I/O are skipped until next
+ * time. Mapped devices are not touched at all.
+ */
+static void scull_z_scan(struct work_struct *work)
+{
+	struct scull_dev *dev = container_of(to_delayed_work(work),
+			struct scull_dev, zip.work);
+	unsigned long after = READ_ONCE(dev->zip.after), item = 0;
+	struct scull_qset *dptr;
+	char *buf = NULL;
+	int quantum = 0, i;
+
+	while (after) {
+		down_read(&dev->sem);
+		if (atomic_read(&dev->vmas))
+			dptr = NULL;
+		else
+			dptr = xa_find(&dev->map->qsets, &item, ULONG_MAX,
+					XA_PRESENT);
+		if (!dptr) {
+			up_read(&dev->sem);
+			break;
+		}
+		if (quantum != dev->quantum) { /* a trim came by */
+			quantum = dev->quantum;
+			kvfree(buf);
+			buf = kvmalloc(quantum, GFP_KERNEL);
+		}
+		if (buf && time_after_eq(jiffies, READ_ONCE(dptr->atime) + after)
+				&& down_write_trylock(&dptr->sem)) {
+			for (i = 0; dptr->data && i < dev->qset; i++)
+				if (dptr->data[i] && scull_is_plain(dptr->data[i]))
+					scull_z_pack(dev, &dptr->data[i], buf);
+			up_write(&dptr->sem);
+		}
+		up_read(&dev->sem);
+		if (++item == 0)
+			break;
+		cond_resched();
+	}
+	kvfree(buf);
+
+	after = READ_ONCE(dev->zip.after);
+	if (after)
+		queue_delayed_work(system_unbound_wq, &dev->zip.work, after);
+}
+
+/*
+ * Inflate a packed quantum into "buf", which is one quantum long. The
+ * caller holds the qset semaphore, either way.
+ */
+int scull_z_inflate(struct scull_dev *dev, void *q, void *buf)
+{
+	struct scull_z_stream *zs = scull_z_get();
+	struct scull_packed *zq = scull_packed(q);
+	unsigned int len = dev->quantum;
+	u64 start = ktime_get_ns();
+	int err;
+
+	err = crypto_comp_decompress(zs->tfm, zq->data, zq->len, buf, &len);
+	atomic64_add(ktime_get_ns() - start, &dev->zip.nsecs);
+	scull_z_put(zs);
+
+	if (!err && len != dev->quantum)
+		err = -EIO;
+	return err;
+}
+
+/*
+ * Turn a packed quantum back into a plain one, before it is written or
+ * mapped. Called with the qset semaphore held for writing.
+ */
+int scull_z_unpack(struct scull_dev *dev, void **slot, gfp_t gfp)
+{
+	struct scull_packed *zq = scull_packed(*slot);
+	int node = scull_node(dev, &gfp);
+	void *data = scull_new_quantum(dev->quantum, node, gfp);
+	int err;
+
+	if (!data)
+		return -ENOMEM;
+	err = scull_z_inflate(dev, *slot, data);
+	if (err) {
+		scull_release_quantum(data, dev->quantum);
+		return err;
+	}
+	atomic_long_dec(&dev->zip.quanta);
+	atomic_long_sub(zq->len, &dev->zip.packed);
+	kfree(zq);
+	*slot = data;
+	return 0;
+}
+
+/*
+ * Start (or stop, with 0) packing the quanta of a device once they have
+ * been idle that many seconds. Stopping leaves what is packed as it is;
+ * it is inflated as it gets written.
+ */
+int scull_z_set(struct scull_dev *dev, unsigned int seconds)
+{
+	int retval = 0;
+
+	if (!seconds) {
+		WRITE_ONCE(dev->zip.after, 0);
+		cancel_delayed_work_sync(&dev->zip.work);
+		return 0;
+	}
+	if (seconds > MAX_JIFFY_OFFSET / HZ)
+		return -EINVAL;
+
+	mutex_lock(&scull_z_mutex);
+	if (!scull_z_streams) {
+		retval = scull_z_alloc();
+		if (retval)
+			printk(KERN_WARNING "scull: no \"%s\" compressor\n",
+					scull_zip_alg);
+	}
+	mutex_unlock(&scull_z_mutex);
+	if (retval)
+		return retval;
+
+	WRITE_ONCE(dev->zip.after, seconds * HZ);
+	mod_delayed_work(system_unbound_wq, &dev->zip.work, seconds * HZ);
+	return 0;
+}
+
+void scull_z_setup(struct scull_dev *dev)
+{
+	dev->zip.after = 0;
+	INIT_DELAYED_WORK(&dev->zip.work, scull_z_scan);
+	atomic_long_set(&dev->zip.quanta, 0);
+	atomic_long_set(&dev->zip.packed, 0);
+	atomic64_set(&dev->zip.nsecs, 0);
+}
+
+/* Called at unload time, once no device can be scanned any more */
+void scull_z_cleanup(void)
+{
+	if (scull_z_streams)
+		scull_z_free(scull_z_streams);
+	scull_z_streams = NULL;
+}
@@ -0,0 +1,237 @@
+/*
+ * dedup.c -- sharing identical quanta between and within scull devices
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+
+#include <linux/kernel.h>	/* printk() */
+#include <linux/slab.h>		/* kmalloc() */
+#include <linux/fs.h>		/* everything... */
+#include <linux/errno.h>	/* error codes */
+#include <linux/types.h>
+#include <linux/cdev.h>
+#include <linux/string.h>	/* memchr_inv() */
+#include <linux/mutex.h>
+#include <linux/refcount.h>
+#include <linux/list.h>
+#include <linux/xxhash.h>
+#include <linux/hash.h>		/* hash_ptr() */
+
+#include "scull.h"		/* local definitions */
+
+/*
+ * Deduplication is off unless asked for: per device with
+ * SCULL_IOCTDEDUP, or for all the bare devices with scull_dedup=1.
+ */
+int scull_dedup = 0;
+module_param(scull_dedup, int, S_IRUGO);
+
+/*
+ * All the quanta that were looked up, whatever device they belong to,
+ * hashed by contents; xxh64 mixes well enough for its low bits to pick
+ * the bucket. Each lock covers the buckets with the same low bits:
+ * their lists, taking a reference to a quantum found there, and
+ * deciding that a quantum has no other holder. The lock of a quantum
+ * is that of its hash (unhashed ones get one from their address), so
+ * writers only wait for each other on quanta that hash alike.
+ */
+#define SCULL_D_BITS  12
+#define SCULL_D_LOCKS 256
+
+static struct hlist_head scull_d_table[1 << SCULL_D_BITS];
+static struct mutex scull_d_locks[SCULL_D_LOCKS];
+
+static struct mutex *scull_d_lock(u64 hash)
+{
+	return &scull_d_locks[hash & (SCULL_D_LOCKS - 1)];
+}
+
+static struct hlist_head *scull_d_bucket(u64 hash)
+{
+	return &scull_d_table[hash & ((1 << SCULL_D_BITS) - 1)];
+}
+
+static struct scull_shared *scull_d_find(void *data, int quantum, u64 hash)
+{
+	struct scull_shared *sh;
+
+	hlist_for_each_entry(sh, scull_d_bucket(hash), node)
+		if (sh->hash == hash && sh->quantum == quantum &&
+				!memcmp(sh->data, data, quantum))
+			return sh;
+	return NULL;
+}
+
+/*
+ * A write just reached the end of the plain quantum at "slot"; called
+ * with the qset semaphore held for writing. A quantum of zeroes is
+ * dropped, as the hole left behind reads the same. Otherwise the
+ * quantum is replaced by an identical one stored before, or entered in
+ * the table for the ones to come. Nothing changes if memory is short.
+ */
+void scull_d_complete(struct scull_dev *dev, void **slot)
+{
+	struct scull_shared *sh, *fresh;
+	void *data = *slot;
+	int quantum = dev->quantum;
+	struct mutex *lock;
+	u64 hash;
+
+	atomic_long_inc(&dev->dedup.hashed);
+	/* memchr_inv() checks a word at a time */
+	if (!memchr_inv(data, 0, quantum)) {
+		atomic_long_inc(&dev->dedup.zero);
+		atomic_long_dec(&dev->nquanta);
+		scull_count(dev, quanta_free, 1);
+		scull_release_quantum(data, quantum);
+		*slot = NULL;
+		return;
+	}
+
+	/* the hashing and the allocation go without the lock */
+	hash = xxh64(data, quantum, 0);
+	fresh = kmalloc(sizeof(struct scull_shared), GFP_KERNEL);
+	lock = scull_d_lock(hash);
+	mutex_lock(lock);
+	sh = scull_d_find(data, quantum, hash);
+	if (sh) {
+		refcount_inc(&sh->ref);
+		mutex_unlock(lock);
+		kfree(fresh);
+		atomic_long_inc(&dev->dedup.hits);
+		scull_release_quantum(data, quantum);
+		*slot = (void *)((unsigned long)sh | SCULL_SHARED);
+		return;
+	}
+
+	if (fresh) {
+		refcount_set(&fresh->ref, 1);
+		fresh->quantum = quantum;
+		fresh->data = data;
+		fresh->hash = hash;
+		hlist_add_head(&fresh->node, scull_d_bucket(hash));
+		*slot = (void *)((unsigned long)fresh | SCULL_SHARED);
+	}
+	mutex_unlock(lock);
+}
+
+/*
+ * Drop a reference to a shared quantum, freeing it with the last one.
+ */
+void scull_d_put(struct scull_shared *sh)
+{
+	struct mutex *lock = scull_d_lock(sh->hash);
+
+	if (!refcount_dec_and_mutex_lock(&sh->ref, lock))
+		return;
+	if (!hlist_unhashed(&sh->node))
+		hlist_del_init(&sh->node);
+	mutex_unlock(lock);
+	scull_release_quantum(sh->data, sh->quantum);
+	kfree(sh);
+}
+
+/*
+ * Give the slot a plain quantum of its own, to be written or mapped:
+ * the shared one is copied, unless the slot turns out to be its only
+ * holder. Called with the qset semaphore held for writing.
+ */
+int scull_d_unshare(struct scull_dev *dev, void **slot, gfp_t gfp)
+{
+	struct scull_shared *sh = scull_shared(*slot);
+	struct mutex *lock = scull_d_lock(sh->hash);
+	void *data;
+	int node;
+
+	mutex_lock(lock);
+	if (refcount_read(&sh->ref) == 1) {
+		/* nobody can find it any more once out of the table */
+		if (!hlist_unhashed(&sh->node))
+			hlist_del_init(&sh->node);
+		mutex_unlock(lock);
+		*slot = sh->data;
+		kfree(sh);
+		return 0;
+	}
+	mutex_unlock(lock);
+
+	node = scull_node(dev, &gfp);
+	data = scull_new_quantum(sh->quantum, node, gfp);
+	if (!data)
+		return -ENOMEM;
+	memcpy(data, sh->data, sh->quantum);
+	*slot = data;
+	scull_d_put(sh);
+	atomic_long_inc(&dev->dedup.cows);
+	return 0;
+}
+
+/*
+ * Let a second slot, "copy", point to the quantum at "slot", when a qset
+ * shared with a snapshot is copied. Plain quanta get a descriptor that
+ * stays out of the table; packed ones are small, and simply duplicated.
+ */
+int scull_d_share(void **slot, void **copy, int quantum, gfp_t gfp)
+{
+	struct scull_shared *sh;
+	struct scull_packed *zq;
+	void *q = *slot;
+
+	if (!q || scull_is_shared(q)) {
+		/* the slot holds a reference, so it cannot go away */
+		if (q)
+			refcount_inc(&scull_shared(q)->ref);
+		*copy = q;
+		return 0;
+	}
+	if (scull_is_packed(q)) {
+		zq = scull_packed(q);
+		zq = kmemdup(zq, sizeof(*zq) + zq->len, gfp);
+		if (!zq)
+			return -ENOMEM;
+		*copy = (void *)((unsigned long)zq | SCULL_PACKED);
+		return 0;
+	}
+
+	sh = kmalloc(sizeof(struct scull_shared), gfp);
+	if (!sh)
+		return -ENOMEM;
+	refcount_set(&sh->ref, 2);
+	sh->quantum = quantum;
+	sh->data = q;
+	sh->hash = hash_ptr(q, 32);	/* only spreads the locks */
+	INIT_HLIST_NODE(&sh->node);
+	*slot = *copy = (void *)((unsigned long)sh | SCULL_SHARED);
+	return 0;
+}
+
+/* Called once at load time, before any device is set up */
+void scull_d_init(void)
+{
+	int i;
+
+	for (i = 0; i < SCULL_D_LOCKS; i++)
+		mutex_init(&scull_d_locks[i]);
+}
+
+void scull_d_setup(struct scull_dev *dev)
+{
+	dev->dedup.on = 0;
+	atomic_long_set(&dev->dedup.hashed, 0);
+	atomic_long_set(&dev->dedup.hits, 0);
+	atomic_long_set(&dev->dedup.zero, 0);
+	atomic_long_set(&dev->dedup.cows, 0);
+}
@@ -0,0 +1,235 @@
+/*
+ * dyn.c -- scull devices created and destroyed on demand
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+
+#include <linux/kernel.h>	/* printk() */
+#include <linux/slab.h>		/* kmalloc() */
+#include <linux/fs.h>		/* everything... */
+#include <linux/errno.h>	/* error codes */
+#include <linux/types.h>
+#include <linux/cdev.h>
+#include <linux/device.h>	/* class_create(), device_add() */
+#include <linux/capability.h>
+#include <linux/mutex.h>
+#include <linux/xarray.h>
+
+#include "scull.h"		/* local definitions */
+
+/*
+ * Besides the devices set up at load time, bare scull devices can be
+ * made at run time: SCULL_IOCCREATE on /dev/scullctl returns a number
+ * N, and /dev/sculldN shows up through the "scull" class (devtmpfs or
+ * udev make the node); SCULL_IOCDESTROY N removes it. They have a
+ * major of their own, minor 0 being the control device, and cost
+ * nothing until created. They follow the policies of the devices made
+ * at load time, but for their page order, scull_dyn_order.
+ *
+ * A device destroyed while open lives on until closed: the cdev holds
+ * a reference to the struct device, which frees it all when released.
+ */
+static int scull_dyn_max = 65536;	/* minors, the control one included */
+static int scull_dyn_order = -1;	/* as scull_order, for all of them */
+module_param(scull_dyn_max, int, S_IRUGO);
+module_param(scull_dyn_order, int, S_IRUGO);
+
+struct scull_dyn {
+	struct scull_dev dev;
+	struct device device;
+};
+
+static dev_t scull_dyn_devno;		/* the control device */
+static struct class *scull_class;
+static struct cdev scull_dyn_cdev;
+static struct device *scull_dyn_ctl;
+static DEFINE_XARRAY_ALLOC1(scull_dyn_devs);	/* by minor */
+static DEFINE_MUTEX(scull_dyn_mutex);		/* creation and removal */
+
+static void scull_dyn_release(struct device *device)
+{
+	struct scull_dyn *d = container_of(device, struct scull_dyn, device);
+
+	scull_dev_cleanup(&d->dev);
+	kfree(d);
+}
+
+static long scull_dyn_create(void)
+{
+	struct scull_dyn *d;
+	u32 minor;
+	int err;
+
+	d = kzalloc(sizeof(struct scull_dyn), GFP_KERNEL);
+	if (!d)
+		return -ENOMEM;
+	err = scull_dev_init(&d->dev);
+	if (err) {
+		kfree(d);
+		return err;
+	}
+
+	mutex_lock(&scull_dyn_mutex);
+	err = xa_alloc(&scull_dyn_devs, &minor, d,
+			XA_LIMIT(1, scull_dyn_max - 1), GFP_KERNEL);
+	if (err) {
+		mutex_unlock(&scull_dyn_mutex);
+		scull_dev_cleanup(&d->dev);
+		kfree(d);
+		return err == -EBUSY ? -ENOSPC : err;
+	}
+
+	/* from here on, the release method frees it all */
+	device_initialize(&d->device);
+	d->device.class = scull_class;
+	d->device.devt = scull_dyn_devno + minor;
+	d->device.release = scull_dyn_release;
+	err = dev_set_name(&d->device, "sculld%u", minor);
+	if (err)
+		goto fail;
+	scull_dev_setup(&d->dev, scull_dyn_order, dev_name(&d->device));
+	scull_debugfs_add(&d->dev, dev_name(&d->device));
+	cdev_init(&d->dev.cdev, &scull_fops);
+	d->dev.cdev.owner = THIS_MODULE;
+	err = cdev_device_add(&d->dev.cdev, &d->device);
+	if (err)
+		goto fail;
+	mutex_unlock(&scull_dyn_mutex);
+	return minor;
+
+  fail:
+	xa_erase(&scull_dyn_devs, minor);
+	mutex_unlock(&scull_dyn_mutex);
+	put_device(&d->device);
+	return err;
+}
+
+/*
+ * Take a device out of sight; it is freed when the last user is gone.
+ * The stats file goes now, as a new device may soon reuse the name.
+ */
+static void scull_dyn_remove(struct scull_dyn *d)
+{
+	cdev_device_del(&d->dev.cdev, &d->device);
+	scull_debugfs_remove(&d->dev);
+}
+
+static long scull_dyn_destroy(unsigned long minor)
+{
+	struct scull_dyn *d;
+
+	mutex_lock(&scull_dyn_mutex);
+	d = xa_erase(&scull_dyn_devs, minor);
+	if (d)
+		scull_dyn_remove(d);
+	mutex_unlock(&scull_dyn_mutex);
+	if (!d)
+		return -ENODEV;
+	put_device(&d->device);
+	return 0;
+}
+
+static long scull_dyn_ioctl(struct file *filp, unsigned int cmd,
+		unsigned long arg)
+{
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	switch(cmd) {
+	  case SCULL_IOCCREATE:
+		return scull_dyn_create();
+
+	  case SCULL_IOCDESTROY:
+		return scull_dyn_destroy(arg);
+
+	  default:
+		return -ENOTTY;
+	}
+}
+
+static struct file_operations scull_dyn_fops = {
+	.owner =    THIS_MODULE,
+	.llseek =   no_llseek,
+	.open =     nonseekable_open,
+	.unlocked_ioctl = scull_dyn_ioctl,
+};
+
+int scull_dyn_init(void)
+{
+	int err;
+
+	if (scull_dyn_max < 2 || scull_dyn_max > MINORMASK + 1) {
+		printk(KERN_WARNING "scull: bad scull_dyn_max %d\n",
+				scull_dyn_max);
+		return -EINVAL;
+	}
+	err = alloc_chrdev_region(&scull_dyn_devno, 0, scull_dyn_max,
+			"sculld");
+	if (err)
+		return err;
+
+	scull_class = class_create(THIS_MODULE, "scull");
+	if (IS_ERR(scull_class)) {
+		err = PTR_ERR(scull_class);
+		scull_class = NULL;
+		goto fail;
+	}
+
+	cdev_init(&scull_dyn_cdev, &scull_dyn_fops);
+	scull_dyn_cdev.owner = THIS_MODULE;
+	err = cdev_add(&scull_dyn_cdev, scull_dyn_devno, 1);
+	if (err)
+		goto fail;
+	scull_dyn_ctl = device_create(scull_class, NULL, scull_dyn_devno, NULL,
+			"scullctl");
+	if (IS_ERR(scull_dyn_ctl)) {
+		err = PTR_ERR(scull_dyn_ctl);
+		scull_dyn_ctl = NULL;
+		cdev_del(&scull_dyn_cdev);
+		goto fail;
+	}
+	return 0;
+
+  fail:
+	if (scull_class)
+		class_destroy(scull_class);
+	scull_class = NULL;
+	unregister_chrdev_region(scull_dyn_devno, scull_dyn_max);
+	return err;
+}
+
+/*
+ * At unload time nobody has a device open, so they all go right away.
+ * Must not fail even if scull_dyn_init() did.
+ */
+void scull_dyn_cleanup(void)
+{
+	struct scull_dyn *d;
+	unsigned long minor;
+
+	if (!scull_class)
+		return;
+	xa_for_each(&scull_dyn_devs, minor, d) {
+		xa_erase(&scull_dyn_devs, minor);
+		scull_dyn_remove(d);
+		put_device(&d->device);
+	}
+	device_destroy(scull_class, scull_dyn_devno);
+	cdev_del(&scull_dyn_cdev);
+	class_destroy(scull_class);
+	scull_class = NULL;
+	unregister_chrdev_region(scull_dyn_devno, scull_dyn_max);
+}
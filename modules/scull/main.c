@@ -20,19 +20,31 @@
 
 #include <linux/kernel.h>	/* printk() */
 #include <linux/slab.h>		/* kmalloc() */
+#include <linux/mm.h>		/* alloc_pages(), vm_operations_struct */
 #include <linux/fs.h>		/* everything... */
 #include <linux/errno.h>	/* error codes */
 #include <linux/types.h>	/* size_t */
 #include <linux/proc_fs.h>
 #include <linux/fcntl.h>	/* O_ACCMODE */
 #include <linux/seq_file.h>
+#include <linux/debugfs.h>
+#include <linux/percpu.h>
 #include <linux/cdev.h>
+#include <linux/xarray.h>
+#include <linux/uio.h>		/* struct iov_iter */
+#include <linux/workqueue.h>
+#include <linux/file.h>		/* fdget() */
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>	/* add_to_pipe() */
 
 #include <linux/uaccess.h>	/* copy_*_user */
 
 #include "scull.h"		/* local definitions */
 #include "access_ok_version.h"
 
+#define CREATE_TRACE_POINTS
+#include "scull_trace.h"
+
 /*
  * Our parameters which can be set at load time.
  */
@@ -42,12 +54,26 @@ int scull_minor =   0;
 int scull_nr_devs = SCULL_NR_DEVS;	/* number of bare scull devices */
 int scull_quantum = SCULL_QUANTUM;
 int scull_qset =    SCULL_QSET;
+int scull_small =   SCULL_SMALL;	/* largest device kept in one buffer */
+int scull_numa =    SCULL_NUMA_LOCAL;	/* placement of the bare devices */
 
 module_param(scull_major, int, S_IRUGO);
 module_param(scull_minor, int, S_IRUGO);
 module_param(scull_nr_devs, int, S_IRUGO);
 module_param(scull_quantum, int, S_IRUGO);
 module_param(scull_qset, int, S_IRUGO);
+module_param(scull_small, int, S_IRUGO);
+module_param(scull_numa, int, S_IRUGO);
+
+/*
+ * Per-device storage: a page order puts a device in page mode, where
+ * every quantum is PAGE_SIZE << order bytes of physically contiguous
+ * memory from alloc_pages(); -1 (or no entry) keeps the kmalloc'ed
+ * scull_quantum. E.g. "scull_order=-1,0,2" for scull1 and scull2.
+ */
+static int scull_order[SCULL_MAX_DEVS];
+static int scull_order_nr;
+module_param_array(scull_order, int, &scull_order_nr, S_IRUGO);
 
 MODULE_AUTHOR("Alessandro Rubini, Jonathan Corbet");
 MODULE_LICENSE("Dual BSD/GPL");
@@ -55,32 +81,321 @@ MODULE_LICENSE("Dual BSD/GPL");
 struct scull_dev *scull_devices;	/* allocated in scull_init_module */
 
 
+/*
+ * Quanta that are a whole number of pages come straight from the page
+ * allocator, as compound pages, so that the fault handler can hand
+ * them to user space. Odd-sized quanta are kmalloc'ed as usual.
+ * Devices in page mode always have such quanta.
+ */
+static inline int scull_quantum_paged(int quantum)
+{
+	return !(quantum & ~PAGE_MASK);
+}
+
+/* The quantum a device gets when emptied: fixed in page mode */
+static int scull_dev_quantum(struct scull_dev *dev)
+{
+	if (dev->order >= 0)
+		return PAGE_SIZE << dev->order;
+	return scull_quantum;
+}
+
+static int scull_numa_valid(int node)
+{
+	if (node == SCULL_NUMA_LOCAL || node == SCULL_NUMA_INTERLEAVE)
+		return 1;
+	return node >= 0 && node < nr_node_ids && node_online(node);
+}
+
+/*
+ * The node the next quantum or qset of a device goes to, following its
+ * policy. A device bound to a node rather fails than goes elsewhere, so
+ * "gfp" may get __GFP_THISNODE.
+ */
+int scull_node(struct scull_dev *dev, gfp_t *gfp)
+{
+	int node = READ_ONCE(dev->node);
+
+	if (node == SCULL_NUMA_LOCAL)
+		return NUMA_NO_NODE; /* whatever node the writer runs on */
+	if (node == SCULL_NUMA_INTERLEAVE) {
+		/* writers racing here only make the round less even */
+		node = next_node_in(READ_ONCE(dev->rotor), node_online_map);
+		WRITE_ONCE(dev->rotor, node);
+		return node;
+	}
+	*gfp |= __GFP_THISNODE;
+	return node;
+}
+
+/*
+ * New quanta are zeroed: the parts nobody wrote read back as the
+ * hole they used to be, and a mapping never shows stale memory.
+ */
+void *scull_new_quantum(int quantum, int node, gfp_t gfp)
+{
+	struct page *page;
+
+	if (!scull_quantum_paged(quantum))
+		return kzalloc_node(quantum, gfp, node);
+	page = alloc_pages_node(node, gfp | __GFP_COMP | __GFP_ZERO,
+			get_order(quantum));
+	return page ? page_address(page) : NULL;
+}
+
+static void *scull_alloc_quantum(struct scull_dev *dev, gfp_t gfp)
+{
+	int node = scull_node(dev, &gfp);
+	void *data = scull_new_quantum(dev->quantum, node, gfp);
+
+	if (data) {
+		atomic_long_inc(&dev->nquanta);
+		scull_count(dev, quanta_alloc, 1);
+	} else {
+		scull_count(dev, alloc_fail, 1);
+	}
+	return data;
+}
+
+void scull_release_quantum(void *data, int quantum)
+{
+	if (scull_is_shared(data))
+		scull_d_put(scull_shared(data));
+	else if (scull_is_packed(data))
+		kfree(scull_packed(data));
+	else if (!scull_quantum_paged(quantum))
+		kfree(data);
+	else
+		__free_pages(virt_to_page(data), get_order(quantum));
+}
+
+static void scull_free_quantum(struct scull_dev *dev, void *data)
+{
+	if (!data)
+		return;
+	atomic_long_dec(&dev->nquanta);
+	scull_count(dev, quanta_free, 1);
+	if (scull_is_packed(data)) {
+		atomic_long_dec(&dev->zip.quanta);
+		atomic_long_sub(scull_packed(data)->len, &dev->zip.packed);
+	}
+	scull_release_quantum(data, dev->quantum);
+}
+
+/*
+ * Make the quantum at "slot" plain memory of this device's own, before
+ * it is written or mapped: packed quanta are inflated, shared ones
+ * copied. Called with the qset semaphore held for writing.
+ */
+static int scull_own_quantum(struct scull_dev *dev, void **slot, gfp_t gfp)
+{
+	if (scull_is_packed(*slot))
+		return scull_z_unpack(dev, slot, gfp);
+	if (scull_is_shared(*slot))
+		return scull_d_unshare(dev, slot, gfp);
+	return 0;
+}
+
+/*
+ * Drop a map's hold on a qset; the last one frees it and its quanta.
+ * Only snapshots share qsets with the device they were taken from.
+ */
+void scull_put_qset(struct scull_qset *dptr, int quantum, int qset)
+{
+	int i;
+
+	if (!refcount_dec_and_test(&dptr->ref))
+		return;
+	if (dptr->data) {
+		for (i = 0; i < qset; i++)
+			if (dptr->data[i])
+				scull_release_quantum(dptr->data[i], quantum);
+		kfree(dptr->data);
+	}
+	kfree(dptr);
+}
+
+/*
+ * Free everything in a map, which nobody else may be looking at,
+ * and leave it empty. This is the slow part of a trim.
+ */
+static void scull_empty_map(struct scull_map *map)
+{
+	struct scull_qset *dptr;
+	unsigned long item;
+
+	xa_for_each(&map->qsets, item, dptr) { /* all the list items */
+		scull_put_qset(dptr, map->quantum, map->qset);
+		cond_resched();
+	}
+	xa_destroy(&map->qsets);
+}
+
+/*
+ * Detached maps are freed here, in the background; the workqueue is
+ * unbound, so several big devices are torn down in parallel.
+ */
+static struct workqueue_struct *scull_free_wq;
+
+static void scull_free_map_work(struct work_struct *work)
+{
+	struct scull_map *map = container_of(work, struct scull_map, work);
+
+	scull_empty_map(map);
+	kfree(map);
+}
+
+static struct scull_map *scull_new_map(gfp_t gfp)
+{
+	struct scull_map *map = kmalloc(sizeof(struct scull_map), gfp);
+
+	if (map)
+		xa_init(&map->qsets);
+	return map;
+}
+
 /*
  * Empty out the scull device; must be called with the device
- * semaphore held.
+ * semaphore held for writing, which keeps all I/O out. A device that
+ * is still mapped is left alone, as the mappings refer to its quanta.
+ *
+ * The old map is swapped for an empty one and handed to the free
+ * workqueue, so this takes the same short time however much data the
+ * device held. Only if there is no room for a new map is the old one
+ * emptied on the spot.
  */
 int scull_trim(struct scull_dev *dev)
 {
-	struct scull_qset *next, *dptr;
-	int qset = dev->qset;   /* "dev" is not-null */
-	int i;
+	struct scull_map *map = dev->map, *fresh = NULL;
+	u64 start = scull_trace_start(scull_trim);
+	unsigned long size = dev->size;
 
-	for (dptr = dev->data; dptr; dptr = next) { /* all the list items */
-		if (dptr->data) {
-			for (i = 0; i < qset; i++)
-				kfree(dptr->data[i]);
-			kfree(dptr->data);
-			dptr->data = NULL;
-		}
-		next = dptr->next;
-		kfree(dptr);
+	if (atomic_read(&dev->vmas)) {
+		trace_scull_trim(dev->cdev.dev, 0, size, -EBUSY, start);
+		return -EBUSY;
+	}
+
+	/* the geometry of the quanta goes along with them */
+	map->quantum = dev->quantum;
+	map->qset = dev->qset;
+	if (scull_free_wq && !xa_empty(&map->qsets))
+		fresh = scull_new_map(GFP_KERNEL);
+	if (fresh) {
+		dev->map = fresh;
+		INIT_WORK(&map->work, scull_free_map_work);
+		queue_work(scull_free_wq, &map->work);
+	} else {
+		scull_empty_map(map);
 	}
+
+	kfree(dev->small);
+	dev->small = NULL;
+	scull_count(dev, trims, 1);
+	scull_count(dev, quanta_free, atomic_long_read(&dev->nquanta));
+	scull_count(dev, qsets_free, atomic_long_read(&dev->nqsets));
+	atomic_long_set(&dev->nquanta, 0);
+	atomic_long_set(&dev->nqsets, 0);
+	atomic_long_set(&dev->zip.quanta, 0);
+	atomic_long_set(&dev->zip.packed, 0);
 	dev->size = 0;
+	dev->quantum = scull_dev_quantum(dev);
+	dev->qset = scull_qset;
+	trace_scull_trim(dev->cdev.dev, 0, size, 0, start);
+	return 0;
+}
+
+/*
+ * Initialize an empty device; used for the bare devices and the
+ * access-controlled ones alike.
+ */
+int scull_dev_init(struct scull_dev *dev)
+{
+	dev->map = scull_new_map(GFP_KERNEL);
+	if (!dev->map)
+		return -ENOMEM;
+	dev->stats = alloc_percpu(struct scull_stats);
+	if (!dev->stats) {
+		kfree(dev->map);
+		dev->map = NULL;
+		return -ENOMEM;
+	}
+	dev->order = -1;
 	dev->quantum = scull_quantum;
 	dev->qset = scull_qset;
-	dev->data = NULL;
+	dev->small = NULL;
+	dev->origin = NULL;
+	dev->node = SCULL_NUMA_LOCAL;
+	dev->rotor = NUMA_NO_NODE;
+	atomic_set(&dev->vmas, 0);
+	atomic_long_set(&dev->nquanta, 0);
+	atomic_long_set(&dev->nqsets, 0);
+	scull_z_setup(dev);
+	scull_d_setup(dev);
+	init_rwsem(&dev->sem);
 	return 0;
 }
+
+/*
+ * Then the load-time policies of a bare device, whether made at load
+ * time or later (see dyn.c): its page order, -1 for kmalloc, then
+ * compression, dedup and NUMA placement. "name" is for the warnings.
+ */
+void scull_dev_setup(struct scull_dev *dev, int order, const char *name)
+{
+	if (order >= 0) {
+		if (order < MAX_ORDER)
+			dev->order = order;
+		else
+			printk(KERN_WARNING "%s: order %d too large,"
+				" using kmalloc\n", name, order);
+	}
+	dev->quantum = scull_dev_quantum(dev);
+	if (scull_zip_after > 0 && scull_z_set(dev, scull_zip_after))
+		printk(KERN_WARNING "%s: not compressing\n", name);
+	dev->dedup.on = !!scull_dedup;
+	if (scull_numa_valid(scull_numa))
+		dev->node = scull_numa;
+	else
+		printk(KERN_WARNING "%s: no node %d, allocating locally\n",
+			name, scull_numa);
+}
+
+/*
+ * And the reverse, when the device goes away. It must not fail, even
+ * if the device never got initialized.
+ */
+void scull_dev_cleanup(struct scull_dev *dev)
+{
+	scull_debugfs_remove(dev);
+	if (!dev->map)
+		return;
+	scull_z_set(dev, 0);
+	scull_trim(dev);
+	kfree(dev->map);
+	dev->map = NULL;
+	free_percpu(dev->stats);
+	dev->stats = NULL;
+}
+
+/*
+ * The memory a device holds, bookkeeping included. Called with the
+ * device semaphore held.
+ */
+static u64 scull_footprint(struct scull_dev *dev)
+{
+	u64 bytes;
+
+	bytes = sizeof(struct scull_map) +
+		(u64)atomic_long_read(&dev->nquanta) * dev->quantum +
+		(u64)atomic_long_read(&dev->nqsets) *
+		(sizeof(struct scull_qset) + dev->qset * sizeof(void *));
+	if (dev->small)
+		bytes += ksize(dev->small);
+	/* packed quanta take less than the full quantum counted above */
+	bytes -= (u64)atomic_long_read(&dev->zip.quanta) * dev->quantum -
+		atomic_long_read(&dev->zip.packed);
+	return bytes;
+}
 #ifdef SCULL_DEBUG /* use proc only if debugging */
 /*
  * The proc filesystem: function to read and entry
@@ -93,22 +408,32 @@ int scull_read_procmem(struct seq_file *s, void *v)
 
         for (i = 0; i < scull_nr_devs && s->count <= limit; i++) {
                 struct scull_dev *d = &scull_devices[i];
-                struct scull_qset *qs = d->data;
-                if (mutex_lock_interruptible(&d->lock))
+                struct scull_qset *qs, *last = NULL;
+                unsigned long item;
+                if (down_read_killable(&d->sem))
                         return -ERESTARTSYS;
                 seq_printf(s,"\nDevice %i: qset %i, q %i, sz %li\n",
                              i, d->qset, d->quantum, d->size);
-                for (; qs && s->count <= limit; qs = qs->next) { /* scan the list */
-                        seq_printf(s, "  item at %p, qset at %p\n",
-                                     qs, qs->data);
-                        if (qs->data && !qs->next) /* dump only the last item */
-                                for (j = 0; j < d->qset; j++) {
-                                        if (qs->data[j])
-                                                seq_printf(s, "    % 4i: %8p\n",
-                                                             j, qs->data[j]);
-                                }
+                if (d->small)
+                        seq_printf(s, "  small data at %p\n", d->small);
+                xa_for_each(&d->map->qsets, item, qs) { /* scan the map */
+                        if (s->count > limit)
+                                break;
+                        seq_printf(s, "  item %lu at %p, qset at %p\n",
+                                     item, qs, qs->data);
+                        last = qs;
+                }
+                if (last) { /* dump only the last item */
+                        down_read(&last->sem);
+                        for (j = 0; last->data && j < d->qset &&
+                                        s->count <= limit; j++) {
+                                if (last->data[j])
+                                        seq_printf(s, "    % 4i: %8p\n",
+                                                     j, last->data[j]);
+                        }
+                        up_read(&last->sem);
                 }
-                mutex_unlock(&scull_devices[i].lock);
+                up_read(&scull_devices[i].sem);
         }
         return 0;
 }
@@ -142,24 +467,32 @@ static void scull_seq_stop(struct seq_file *s, void *v)
 static int scull_seq_show(struct seq_file *s, void *v)
 {
 	struct scull_dev *dev = (struct scull_dev *) v;
-	struct scull_qset *d;
+	struct scull_qset *d, *last = NULL;
+	unsigned long item;
 	int i;
 
-	if (mutex_lock_interruptible(&dev->lock))
+	if (down_read_killable(&dev->sem))
 		return -ERESTARTSYS;
 	seq_printf(s, "\nDevice %i: qset %i, q %i, sz %li\n",
 			(int) (dev - scull_devices), dev->qset,
 			dev->quantum, dev->size);
-	for (d = dev->data; d; d = d->next) { /* scan the list */
-		seq_printf(s, "  item at %p, qset at %p\n", d, d->data);
-		if (d->data && !d->next) /* dump only the last item */
-			for (i = 0; i < dev->qset; i++) {
-				if (d->data[i])
-					seq_printf(s, "    % 4i: %8p\n",
-							i, d->data[i]);
-			}
+	if (dev->small)
+		seq_printf(s, "  small data at %p\n", dev->small);
+	xa_for_each(&dev->map->qsets, item, d) { /* scan the map */
+		seq_printf(s, "  item %lu at %p, qset at %p\n",
+				item, d, d->data);
+		last = d;
 	}
-	mutex_unlock(&dev->lock);
+	if (last) { /* dump only the last item */
+		down_read(&last->sem);
+		for (i = 0; last->data && i < dev->qset; i++) {
+			if (last->data[i])
+				seq_printf(s, "    % 4i: %8p\n",
+						i, last->data[i]);
+		}
+		up_read(&last->sem);
+	}
+	up_read(&dev->sem);
 	return 0;
 }
 	
@@ -229,6 +562,132 @@ static void scull_remove_proc(void)
 
 #endif /* SCULL_DEBUG */
 
+/*
+ * The counters are always kept, as they cost next to nothing; debugfs
+ * shows them, one file per bare device.
+ */
+static struct dentry *scull_debugfs;
+
+/*
+ * Where the quanta of a device are, node by node, for checking that
+ * the placement policy does what it should. Called with the device
+ * semaphore held.
+ */
+static void scull_numa_show(struct seq_file *s, struct scull_dev *dev)
+{
+	struct scull_qset *dptr;
+	unsigned long item, *nr;
+	void *q;
+	int i, node = READ_ONCE(dev->node);
+
+	if (node == SCULL_NUMA_LOCAL)
+		seq_puts(s, "numa:   local,");
+	else if (node == SCULL_NUMA_INTERLEAVE)
+		seq_puts(s, "numa:   interleave,");
+	else
+		seq_printf(s, "numa:   node %d,", node);
+
+	nr = kcalloc(nr_node_ids, sizeof(*nr), GFP_KERNEL);
+	if (!nr) {
+		seq_puts(s, " no memory to count\n");
+		return;
+	}
+	xa_for_each(&dev->map->qsets, item, dptr) {
+		down_read(&dptr->sem);
+		for (i = 0; dptr->data && i < dev->qset; i++) {
+			q = dptr->data[i];
+			if (!q)
+				continue;
+			if (scull_is_shared(q))
+				q = scull_shared(q)->data;
+			else if (scull_is_packed(q))
+				q = scull_packed(q);
+			nr[page_to_nid(virt_to_page(q))]++;
+		}
+		up_read(&dptr->sem);
+		cond_resched();
+	}
+	for_each_node(i)
+		if (nr[i] || node_online(i))
+			seq_printf(s, " %lu quanta on node %d", nr[i], i);
+	seq_putc(s, '\n');
+	kfree(nr);
+}
+
+static int scull_stats_show(struct seq_file *s, void *v)
+{
+	struct scull_dev *dev = s->private;
+	struct scull_stats sum, *st;
+	u64 footprint;
+	int cpu;
+
+	memset(&sum, 0, sizeof(sum));
+	for_each_possible_cpu(cpu) {
+		st = per_cpu_ptr(dev->stats, cpu);
+		sum.rd_bytes += st->rd_bytes;
+		sum.rd_ops += st->rd_ops;
+		sum.wr_bytes += st->wr_bytes;
+		sum.wr_ops += st->wr_ops;
+		sum.quanta_alloc += st->quanta_alloc;
+		sum.quanta_free += st->quanta_free;
+		sum.qsets_alloc += st->qsets_alloc;
+		sum.qsets_free += st->qsets_free;
+		sum.trims += st->trims;
+		sum.alloc_fail += st->alloc_fail;
+	}
+
+	if (down_read_killable(&dev->sem))
+		return -ERESTARTSYS;
+	seq_printf(s, "read:   %llu bytes in %llu calls\n",
+			sum.rd_bytes, sum.rd_ops);
+	seq_printf(s, "write:  %llu bytes in %llu calls\n",
+			sum.wr_bytes, sum.wr_ops);
+	seq_printf(s, "quanta: %llu allocated, %llu freed, %li held\n",
+			sum.quanta_alloc, sum.quanta_free,
+			atomic_long_read(&dev->nquanta));
+	seq_printf(s, "qsets:  %llu allocated, %llu freed, %li held\n",
+			sum.qsets_alloc, sum.qsets_free,
+			atomic_long_read(&dev->nqsets));
+	seq_printf(s, "trims:  %llu\n", sum.trims);
+	seq_printf(s, "nomem:  %llu\n", sum.alloc_fail);
+	footprint = scull_footprint(dev);
+	seq_printf(s, "memory: %llu bytes for a size of %lu\n",
+			footprint, dev->size);
+	scull_numa_show(s, dev);
+	up_read(&dev->sem);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(scull_stats);
+
+/*
+ * Any device can have a stats file, named after it; scull_dev_cleanup
+ * removes it along with the device, if nobody did before.
+ */
+void scull_debugfs_add(struct scull_dev *dev, const char *name)
+{
+	dev->debugfs = debugfs_create_file(name, 0444, scull_debugfs, dev,
+			&scull_stats_fops);
+}
+
+void scull_debugfs_remove(struct scull_dev *dev)
+{
+	debugfs_remove(dev->debugfs);	/* it points here */
+	dev->debugfs = NULL;
+}
+
+/* before the friend devices, which add their files there too */
+static void scull_create_debugfs(void)
+{
+	char name[16];
+	int i;
+
+	scull_debugfs = debugfs_create_dir("scull", NULL);
+	for (i = 0; i < scull_nr_devs; i++) {
+		snprintf(name, sizeof(name), "scull%d", i);
+		scull_debugfs_add(&scull_devices[i], name);
+	}
+}
+
 
 
 
@@ -246,11 +705,12 @@ int scull_open(struct inode *inode, struct file *filp)
 
 	/* now trim to 0 the length of the device if open was write-only */
 	if ( (filp->f_flags & O_ACCMODE) == O_WRONLY) {
-		if (mutex_lock_interruptible(&dev->lock))
+		if (down_write_killable(&dev->sem))
 			return -ERESTARTSYS;
 		scull_trim(dev); /* ignore errors */
-		mutex_unlock(&dev->lock);
+		up_write(&dev->sem);
 	}
+	filp->f_mode |= FMODE_NOWAIT; /* read_iter/write_iter honor IOCB_NOWAIT */
 	return 0;          /* success */
 }
 
@@ -259,132 +719,967 @@ int scull_release(struct inode *inode, struct file *filp)
 	return 0;
 }
 /*
- * Follow the list
+ * Find listitem, qset index, and offset in the quantum for "pos".
+ */
+static void scull_locate(struct scull_dev *dev, loff_t pos,
+		unsigned long *item, int *s_pos, int *q_pos)
+{
+	long itemsize = (long)dev->quantum * dev->qset;
+	long rest = (long)pos % itemsize;
+
+	*item = (long)pos / itemsize;
+	*s_pos = rest / dev->quantum;
+	*q_pos = rest % dev->quantum;
+}
+
+/*
+ * Look up list item "n", allocating it if need be. The map is indexed
+ * by item number, so this no longer depends on how far into the device
+ * the item lives; items before "n" are not created.
+ *
+ * Writers only hold the device semaphore shared, so two of them may
+ * race to create the same item: the xarray settles it, and the loser
+ * uses the winner's qset.
  */
-struct scull_qset *scull_follow(struct scull_dev *dev, int n)
+struct scull_qset *scull_follow(struct scull_dev *dev, unsigned long n,
+		gfp_t gfp)
 {
-	struct scull_qset *qs = dev->data;
+	u64 start = scull_trace_start(scull_follow);
+	struct scull_qset *qs = xa_load(&dev->map->qsets, n);
+	struct scull_qset *old;
+	gfp_t qgfp = gfp;	/* not for the xarray: it may add a node */
+	int made = 0;
 
-        /* Allocate first qset explicitly if need be */
-	if (! qs) {
-		qs = dev->data = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
-		if (qs == NULL)
-			return NULL;  /* Never mind */
-		memset(qs, 0, sizeof(struct scull_qset));
+	if (qs)
+		goto out;
+
+	qs = kzalloc_node(sizeof(struct scull_qset), qgfp,
+			scull_node(dev, &qgfp));
+	if (qs == NULL)
+		goto fail;
+	init_rwsem(&qs->sem);
+	refcount_set(&qs->ref, 1);
+	qs->atime = jiffies;
+	old = xa_cmpxchg(&dev->map->qsets, n, NULL, qs, gfp);
+	if (old) {
+		kfree(qs);
+		qs = NULL;
+		if (xa_is_err(old))
+			goto fail;
+		qs = old;
+		goto out;
 	}
+	atomic_long_inc(&dev->nqsets);
+	scull_count(dev, qsets_alloc, 1);
+	made = 1;
+	goto out;
+
+  fail:
+	scull_count(dev, alloc_fail, 1); /* Never mind */
+  out:
+	trace_scull_follow(dev->cdev.dev, n, qs ? made : -ENOMEM, start);
+	return qs;
+}
 
-	/* Then follow the list */
-	while (n--) {
-		if (!qs->next) {
-			qs->next = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
-			if (qs->next == NULL)
-				return NULL;  /* Never mind */
-			memset(qs->next, 0, sizeof(struct scull_qset));
+/*
+ * Give a qset its array of quantum pointers, if it has none yet; called
+ * with the qset semaphore held for writing.
+ */
+static int scull_qset_slots(struct scull_dev *dev, struct scull_qset *dptr,
+		gfp_t gfp)
+{
+	int node;
+
+	if (dptr->data)
+		return 0;
+	node = scull_node(dev, &gfp);
+	dptr->data = kcalloc_node(dev->qset, sizeof(char *), gfp, node);
+	if (dptr->data)
+		return 0;
+	scull_count(dev, alloc_fail, 1);
+	return -ENOMEM;
+}
+
+/*
+ * Look up item "n" like scull_follow, and lock it for writing. A qset
+ * still shared with a snapshot is copied first, so that what we get is
+ * the device's own; since another writer may have done that while we
+ * waited for the lock, the qset has to be checked against the map.
+ */
+static struct scull_qset *scull_follow_write(struct scull_dev *dev,
+		unsigned long n, bool nowait, gfp_t gfp)
+{
+	struct scull_qset *qs, *copy;
+
+	for (;;) {
+		qs = scull_follow(dev, n, gfp);
+		if (!qs)
+			return ERR_PTR(nowait ? -EAGAIN : -ENOMEM);
+		if (nowait) {
+			if (!down_write_trylock(&qs->sem))
+				return ERR_PTR(-EAGAIN);
+		} else if (down_write_killable(&qs->sem)) {
+			return ERR_PTR(-ERESTARTSYS);
 		}
-		qs = qs->next;
-		continue;
+		if (xa_load(&dev->map->qsets, n) == qs)
+			break;
+		up_write(&qs->sem);
 	}
-	return qs;
+	if (refcount_read(&qs->ref) == 1)
+		return qs;
+
+	copy = scull_snap_clone(dev, n, qs, gfp);
+	if (!copy) {
+		up_write(&qs->sem);
+		return ERR_PTR(nowait ? -EAGAIN : -ENOMEM);
+	}
+	return copy;
 }
 
 /*
  * Data management: read and write
  */
 
-ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+/*
+ * Locking is two-level. The device semaphore protects the shape of
+ * the device (which qsets exist, their geometry): I/O holds it shared,
+ * trim and friends exclusively. Each qset has a semaphore of its own
+ * for the quanta it points to, so that writers working on different
+ * qsets go in parallel. The device semaphore is always taken first.
+ *
+ * IOCB_NOWAIT callers (io_uring, preadv2 with RWF_NOWAIT) must not
+ * sleep, so they get -EAGAIN instead of waiting for a busy lock.
+ */
+static int scull_io_lock(struct scull_dev *dev, struct kiocb *iocb)
 {
-	struct scull_dev *dev = filp->private_data; 
-	struct scull_qset *dptr;	/* the first listitem */
-	int quantum = dev->quantum, qset = dev->qset;
-	int itemsize = quantum * qset; /* how many bytes in the listitem */
-	int item, s_pos, q_pos, rest;
-	ssize_t retval = 0;
-
-	if (mutex_lock_interruptible(&dev->lock))
+	if (iocb->ki_flags & IOCB_NOWAIT)
+		return down_read_trylock(&dev->sem) ? 0 : -EAGAIN;
+	if (down_read_killable(&dev->sem))
 		return -ERESTARTSYS;
-	if (*f_pos >= dev->size)
-		goto out;
-	if (*f_pos + count > dev->size)
-		count = dev->size - *f_pos;
+	return 0;
+}
+
+static int scull_qset_lock(struct scull_qset *qs, struct kiocb *iocb,
+		int write)
+{
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (write)
+			return down_write_trylock(&qs->sem) ? 0 : -EAGAIN;
+		return down_read_trylock(&qs->sem) ? 0 : -EAGAIN;
+	}
+	if (write)
+		return down_write_killable(&qs->sem) ? -ERESTARTSYS : 0;
+	return down_read_killable(&qs->sem) ? -ERESTARTSYS : 0;
+}
+
+/*
+ * Grow the device to "pos" if it is shorter; writers of different
+ * qsets may do this concurrently.
+ */
+static void scull_extend(struct scull_dev *dev, unsigned long pos)
+{
+	unsigned long size = READ_ONCE(dev->size), prev;
+
+	while (size < pos) {
+		prev = cmpxchg(&dev->size, size, pos);
+		if (prev == size)
+			break;
+		size = prev;
+	}
+}
+
+/*
+ * The data is copied to and from user memory with the device and qset
+ * semaphores held, so that copy must not fault: the buffer may be a
+ * mapping of this very device, or of another one, whose fault handler
+ * takes the same semaphores. Page faults are disabled around it
+ * instead. When it stops short, the pass ends with *fault set, and
+ * the caller faults the next pages in, with no lock held, and goes on.
+ */
+#define SCULL_FAULT_WINDOW (64 * PAGE_SIZE)
 
-	/* find listitem, qset index, and offset in the quantum */
-	item = (long)*f_pos / itemsize;
-	rest = (long)*f_pos % itemsize;
-	s_pos = rest / quantum; q_pos = rest % quantum;
+static int scull_fault_in(struct iov_iter *iter, int to_user)
+{
+	size_t size = min_t(size_t, iov_iter_count(iter), SCULL_FAULT_WINDOW);
+	size_t left;
+
+	if (to_user)
+		left = fault_in_iov_iter_writeable(iter, size);
+	else
+		left = fault_in_iov_iter_readable(iter, size);
+	return left == size ? -EFAULT : 0;
+}
+
+static size_t scull_copy_to_iter(const void *from, size_t bytes,
+		struct iov_iter *to)
+{
+	size_t copied;
+
+	pagefault_disable();
+	if (from)	/* or a hole */
+		copied = copy_to_iter(from, bytes, to);
+	else
+		copied = iov_iter_zero(bytes, to);
+	pagefault_enable();
+	return copied;
+}
+
+static size_t scull_copy_from_iter(void *to, size_t bytes,
+		struct iov_iter *from)
+{
+	size_t copied;
 
-	/* follow the list up to the right position (defined elsewhere) */
-	dptr = scull_follow(dev, item);
+	pagefault_disable();
+	copied = copy_from_iter(to, bytes, from);
+	pagefault_enable();
+	return copied;
+}
 
-	if (dptr == NULL || !dptr->data || ! dptr->data[s_pos])
-		goto out; /* don't fill holes */
+/*
+ * Small devices. Until it grows past scull_small bytes, a device keeps
+ * its data in a single kmalloc'ed buffer instead of a qset, a pointer
+ * array and a quantum: a one-byte write costs a few dozen bytes instead
+ * of some 12KB. The buffer only changes with the device semaphore held
+ * for writing, so holding it shared is enough to read it.
+ */
+static int scull_small_fits(struct scull_dev *dev, loff_t end)
+{
+	return end <= scull_small && xa_empty(&dev->map->qsets) &&
+		!atomic_read(&dev->vmas);
+}
 
-	/* read only up to the end of this quantum */
-	if (count > quantum - q_pos)
-		count = quantum - q_pos;
+static ssize_t scull_small_write(struct scull_dev *dev, struct kiocb *iocb,
+		struct iov_iter *from, gfp_t gfp)
+{
+	size_t count = iov_iter_count(from), copied;
+	loff_t pos = iocb->ki_pos;
+	char *small = dev->small;
+
+	if (pos + count > dev->size) {
+		/* krealloc keeps the buffer when there is slack left */
+		small = krealloc(dev->small, pos + count, gfp);
+		if (!small)
+			return gfp == GFP_KERNEL ? -ENOMEM : -EAGAIN;
+		dev->small = small;
+		if (pos > dev->size) /* a gap reads as a hole */
+			memset(small + dev->size, 0, pos - dev->size);
+	}
+
+	copied = scull_copy_from_iter(small + pos, count, from);
+	iocb->ki_pos += copied;
+	if (dev->size < iocb->ki_pos)
+		dev->size = iocb->ki_pos;
+	return copied;
+}
+
+/*
+ * Move the data of a small device to quanta, when it outgrows its
+ * buffer or when quanta are needed (mmap, reserve). Called with the
+ * device semaphore held for writing; on failure nothing changes.
+ */
+static int scull_promote(struct scull_dev *dev)
+{
+	struct scull_qset *dptr;
+	unsigned long item;
+	int s_pos, q_pos;
+	loff_t pos;
+	size_t chunk;
+
+	if (!dev->small)
+		return 0;
+
+	for (pos = 0; pos < dev->size; pos += chunk) {
+		scull_locate(dev, pos, &item, &s_pos, &q_pos);
+		chunk = min((size_t)(dev->size - pos),
+				(size_t)(dev->quantum - q_pos));
+		dptr = scull_follow(dev, item, GFP_KERNEL);
+		if (!dptr)
+			goto nomem;
+		if (scull_qset_slots(dev, dptr, GFP_KERNEL))
+			goto nomem;
+		if (!dptr->data[s_pos]) {
+			dptr->data[s_pos] = scull_alloc_quantum(dev, GFP_KERNEL);
+			if (!dptr->data[s_pos])
+				goto nomem;
+		}
+		memcpy(dptr->data[s_pos] + q_pos, dev->small + pos, chunk);
+	}
+
+	kfree(dev->small);
+	dev->small = NULL;
+	return 0;
+
+  nomem: /* the buffer still has it all: drop the partial copy */
+	dev->map->quantum = dev->quantum;
+	dev->map->qset = dev->qset;
+	scull_empty_map(dev->map);
+	scull_count(dev, quanta_free, atomic_long_read(&dev->nquanta));
+	scull_count(dev, qsets_free, atomic_long_read(&dev->nqsets));
+	atomic_long_set(&dev->nquanta, 0);
+	atomic_long_set(&dev->nqsets, 0);
+	return -ENOMEM;
+}
 
-	if (copy_to_user(buf, dptr->data[s_pos] + q_pos, count)) {
-		retval = -EFAULT;
+/*
+ * Read and write work on the device itself, so that the kernel can
+ * move data in and out without a file (see backing.c); only the
+ * position and flags of the kiocb are used.
+ */
+static ssize_t scull_do_read(struct scull_dev *dev, struct kiocb *iocb,
+		struct iov_iter *to, bool *fault)
+{
+	struct scull_qset *dptr = NULL;	/* the listitem, locked */
+	int quantum, qset;
+	unsigned long item, size;
+	int s_pos, q_pos, looked_up = 0;
+	size_t count = iov_iter_count(to);
+	size_t done = 0, chunk, copied;
+	void *q, *buf = NULL;	/* buf: room to inflate packed quanta */
+	ssize_t retval;
+
+	retval = scull_io_lock(dev, iocb);
+	if (retval)
+		return retval;
+	quantum = dev->quantum;	/* stable while we hold the semaphore */
+	qset = dev->qset;
+	size = READ_ONCE(dev->size);
+	if (iocb->ki_pos >= size)
 		goto out;
+	if (iocb->ki_pos + count > size)
+		count = size - iocb->ki_pos;
+
+	if (dev->small) {
+		done = scull_copy_to_iter(dev->small + iocb->ki_pos, count, to);
+		if (done < count)
+			*fault = true;
+		goto finish;
+	}
+
+	scull_locate(dev, iocb->ki_pos, &item, &s_pos, &q_pos);
+
+	/* walk quantum after quantum; holes read back as zeros */
+	while (done < count) {
+		if (!looked_up) {
+			/* look the item up; reading never allocates */
+			dptr = xa_load(&dev->map->qsets, item);
+			looked_up = 1;
+			if (dptr) {
+				retval = scull_qset_lock(dptr, iocb, 0);
+				if (retval) {
+					dptr = NULL;
+					break;
+				}
+				WRITE_ONCE(dptr->atime, jiffies);
+			}
+		}
+
+		chunk = min(count - done, (size_t)(quantum - q_pos));
+		q = dptr && dptr->data ? dptr->data[s_pos] : NULL;
+		if (scull_is_packed(q)) {
+			/* inflate a copy: reading alone does not warm it up */
+			retval = -EAGAIN;
+			if (iocb->ki_flags & IOCB_NOWAIT)
+				break;
+			retval = -ENOMEM;
+			if (!buf)
+				buf = kvmalloc(quantum, GFP_KERNEL);
+			if (!buf)
+				break;
+			retval = scull_z_inflate(dev, q, buf);
+			if (retval)
+				break;
+			copied = scull_copy_to_iter(buf + q_pos, chunk, to);
+		} else if (q) {
+			if (scull_is_shared(q))
+				q = scull_shared(q)->data;
+			copied = scull_copy_to_iter(q + q_pos, chunk, to);
+		} else {
+			copied = scull_copy_to_iter(NULL, chunk, to);
+		}
+		done += copied;
+		if (copied < chunk) {
+			*fault = true;
+			break;
+		}
+
+		/* on to the next quantum, and maybe the next item */
+		q_pos = 0;
+		if (++s_pos == qset) {
+			s_pos = 0;
+			item++;
+			looked_up = 0;
+			if (dptr)
+				up_read(&dptr->sem);
+			dptr = NULL;
+		}
+	}
+	if (dptr)
+		up_read(&dptr->sem);
+	kvfree(buf);
+  finish:
+	if (done) {
+		iocb->ki_pos += done;
+		retval = done;
 	}
-	*f_pos += count;
-	retval = count;
 
   out:
-	mutex_unlock(&dev->lock);
+	up_read(&dev->sem);
 	return retval;
 }
 
-ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
+ssize_t scull_read_dev(struct scull_dev *dev, struct kiocb *iocb,
+		struct iov_iter *to)
 {
-	struct scull_dev *dev = filp->private_data;
-	struct scull_qset *dptr;
-	int quantum = dev->quantum, qset = dev->qset;
-	int itemsize = quantum * qset;
-	int item, s_pos, q_pos, rest;
-	ssize_t retval = -ENOMEM; /* value used in "goto out" statements */
+	loff_t pos = iocb->ki_pos;
+	u64 start = scull_trace_start(scull_read);
+	size_t done = 0;
+	ssize_t retval;
+	bool fault;
+
+	for (;;) {
+		fault = false;
+		retval = scull_do_read(dev, iocb, to, &fault);
+		if (retval > 0)
+			done += retval;
+		if (!fault)
+			break;
+		retval = -EAGAIN; /* faulting pages in may sleep */
+		if (iocb->ki_flags & IOCB_NOWAIT)
+			break;
+		retval = scull_fault_in(to, 1);
+		if (retval)
+			break;
+	}
+	if (done)
+		retval = done;
 
-	if (mutex_lock_interruptible(&dev->lock))
-		return -ERESTARTSYS;
+	scull_count(dev, rd_ops, 1);
+	scull_count(dev, rd_bytes, done);
+	trace_scull_read(dev->cdev.dev, pos, done + iov_iter_count(to),
+			retval, start);
+	return retval;
+}
 
-	/* find listitem, qset index and offset in the quantum */
-	item = (long)*f_pos / itemsize;
-	rest = (long)*f_pos % itemsize;
-	s_pos = rest / quantum; q_pos = rest % quantum;
+ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	return scull_read_dev(iocb->ki_filp->private_data, iocb, to);
+}
 
-	/* follow the list up to the right position */
-	dptr = scull_follow(dev, item);
-	if (dptr == NULL)
-		goto out;
-	if (!dptr->data) {
-		dptr->data = kmalloc(qset * sizeof(char *), GFP_KERNEL);
-		if (!dptr->data)
+static ssize_t scull_do_write(struct scull_dev *dev, struct kiocb *iocb,
+		struct iov_iter *from, bool *fault)
+{
+	struct scull_qset *dptr = NULL;	/* the listitem, locked */
+	int quantum, qset;
+	unsigned long item;
+	int s_pos, q_pos;
+	size_t count = iov_iter_count(from);
+	size_t done = 0, chunk, copied;
+	/* a NOWAIT request may not sleep in the allocator either */
+	bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+	gfp_t gfp = nowait ? GFP_NOWAIT | __GFP_NOWARN : GFP_KERNEL;
+	ssize_t retval;
+
+	retval = scull_io_lock(dev, iocb);
+	if (retval)
+		return retval;
+
+	/* small devices, or those about to outgrow it, need it all */
+	if (dev->small || scull_small_fits(dev, iocb->ki_pos + count)) {
+		up_read(&dev->sem);
+		if (nowait) {
+			if (!down_write_trylock(&dev->sem))
+				return -EAGAIN;
+		} else if (down_write_killable(&dev->sem)) {
+			return -ERESTARTSYS;
+		}
+		if (scull_small_fits(dev, iocb->ki_pos + count)) {
+			retval = scull_small_write(dev, iocb, from, gfp);
+			if (retval >= 0 && retval < count)
+				*fault = true;
+			up_write(&dev->sem);
+			return retval;
+		}
+		/* moving to quanta allocates a lot, and may sleep doing so */
+		if (nowait && dev->small) {
+			up_write(&dev->sem);
+			return -EAGAIN;
+		}
+		retval = scull_promote(dev);
+		downgrade_write(&dev->sem);
+		if (retval)
 			goto out;
-		memset(dptr->data, 0, qset * sizeof(char *));
 	}
-	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] = kmalloc(quantum, GFP_KERNEL);
-		if (!dptr->data[s_pos])
-			goto out;
+
+	quantum = dev->quantum;	/* stable while we hold the semaphore */
+	qset = dev->qset;
+	scull_locate(dev, iocb->ki_pos, &item, &s_pos, &q_pos);
+
+	while (done < count) {
+		retval = nowait ? -EAGAIN : -ENOMEM;
+		if (!dptr) {
+			/* find the item, creating it if need be */
+			dptr = scull_follow_write(dev, item, nowait, gfp);
+			if (IS_ERR(dptr)) {
+				retval = PTR_ERR(dptr);
+				dptr = NULL;
+				break;
+			}
+			WRITE_ONCE(dptr->atime, jiffies);
+			retval = nowait ? -EAGAIN : -ENOMEM;
+		}
+		if (scull_qset_slots(dev, dptr, gfp))
+			break;
+		if (!dptr->data[s_pos]) {
+			dptr->data[s_pos] = scull_alloc_quantum(dev, gfp);
+			if (!dptr->data[s_pos])
+				break;
+		} else if (!scull_is_plain(dptr->data[s_pos])) {
+			if (nowait) /* inflating or unsharing may sleep */
+				break;
+			retval = scull_own_quantum(dev, &dptr->data[s_pos], gfp);
+			if (retval)
+				break;
+		}
+
+		chunk = min(count - done, (size_t)(quantum - q_pos));
+		copied = scull_copy_from_iter(dptr->data[s_pos] + q_pos, chunk,
+				from);
+		done += copied;
+		if (copied < chunk) {
+			*fault = true;
+			break;
+		}
+		/* a quantum just filled up may be a duplicate */
+		if (q_pos + chunk == quantum && dev->dedup.on && !nowait &&
+				!atomic_read(&dev->vmas))
+			scull_d_complete(dev, &dptr->data[s_pos]);
+
+		/* on to the next quantum, and maybe the next item */
+		q_pos = 0;
+		if (++s_pos == qset) {
+			s_pos = 0;
+			item++;
+			up_write(&dptr->sem);
+			dptr = NULL;
+		}
+	}
+	if (dptr)
+		up_write(&dptr->sem);
+	if (done) {
+		iocb->ki_pos += done;
+		retval = done;
+
+		/* update the size */
+		scull_extend(dev, iocb->ki_pos);
 	}
-	/* write only up to the end of this quantum */
-	if (count > quantum - q_pos)
-		count = quantum - q_pos;
 
-	if (copy_from_user(dptr->data[s_pos]+q_pos, buf, count)) {
-		retval = -EFAULT;
+  out:
+	up_read(&dev->sem);
+	return retval;
+}
+
+ssize_t scull_write_dev(struct scull_dev *dev, struct kiocb *iocb,
+		struct iov_iter *from)
+{
+	size_t count = iov_iter_count(from), done = 0;
+	loff_t pos = iocb->ki_pos;
+	u64 start = scull_trace_start(scull_write);
+	ssize_t retval;
+	bool fault;
+
+	for (;;) {
+		fault = false;
+		retval = scull_do_write(dev, iocb, from, &fault);
+		if (retval > 0)
+			done += retval;
+		if (!fault)
+			break;
+		retval = -EAGAIN; /* faulting pages in may sleep */
+		if (iocb->ki_flags & IOCB_NOWAIT)
+			break;
+		retval = scull_fault_in(from, 0);
+		if (retval)
+			break;
+	}
+	if (done)
+		retval = done;
+
+	scull_count(dev, wr_ops, 1);
+	scull_count(dev, wr_bytes, done);
+	trace_scull_write(dev->cdev.dev, pos, count, retval, start);
+	return retval;
+}
+
+ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	return scull_write_dev(iocb->ki_filp->private_data, iocb, from);
+}
+
+/*
+ * splice() out of the device hands the pipe the pages of the quanta
+ * themselves, and the zero page for holes, so that nothing is copied on
+ * the way to a file or a socket. That needs quanta made of pages; other
+ * devices, small ones and packed quanta go through read_iter instead,
+ * which copies straight into the pipe.
+ */
+ssize_t scull_splice_read(struct file *in, loff_t *ppos,
+		struct pipe_inode_info *pipe, size_t len, unsigned int flags)
+{
+	struct scull_dev *dev = in->private_data;
+	struct scull_qset *dptr;
+	struct pipe_buffer buf;
+	struct page *page;
+	unsigned long item, size;
+	int s_pos, q_pos, offset, copy = 0;
+	size_t chunk;
+	ssize_t spliced = 0, retval = 0;
+	void *q;
+
+	if (down_read_killable(&dev->sem))
+		return -ERESTARTSYS;
+	if (dev->small || !scull_quantum_paged(dev->quantum)) {
+		copy = 1;
+		goto out;
+	}
+	size = READ_ONCE(dev->size);
+	if (*ppos >= size)
 		goto out;
+	len = min_t(size_t, len, size - *ppos);
+
+	while (len) {
+		scull_locate(dev, *ppos, &item, &s_pos, &q_pos);
+		dptr = xa_load(&dev->map->qsets, item);
+		if (dptr)
+			down_read(&dptr->sem);
+		q = dptr && dptr->data ? dptr->data[s_pos] : NULL;
+		if (scull_is_shared(q))
+			q = scull_shared(q)->data;
+		if (scull_is_packed(q)) {
+			if (dptr)
+				up_read(&dptr->sem);
+			copy = 1;
+			break;
+		}
+		offset = q_pos & ~PAGE_MASK;
+		chunk = min_t(size_t, len, PAGE_SIZE - offset);
+		page = q ? virt_to_page(q + q_pos) : ZERO_PAGE(0);
+		get_page(page);
+		if (dptr)
+			up_read(&dptr->sem);
+
+		/* a full pipe, or one without readers, drops the page again */
+		buf = (struct pipe_buffer) {
+			.page = page,
+			.offset = offset,
+			.len = chunk,
+			.ops = &nosteal_pipe_buf_ops,
+		};
+		retval = add_to_pipe(pipe, &buf);
+		if (retval < 0)
+			break;
+		*ppos += chunk;
+		len -= chunk;
+		spliced += chunk;
+	}
+
+  out:
+	if (spliced || !copy) { /* read_iter counts the copies */
+		scull_count(dev, rd_ops, 1);
+		scull_count(dev, rd_bytes, spliced);
+	}
+	up_read(&dev->sem);
+	if (spliced)
+		return spliced;
+	if (copy)
+		return generic_file_splice_read(in, ppos, pipe, len, flags);
+	return retval;
+}
+
+/*
+ * Punch a hole: quanta entirely inside [off, off + len) are freed, the
+ * partial ones at the edges are cleared. The size does not change, and
+ * the qsets themselves stay, as other writers may be waiting on them.
+ * While the device is mapped nothing is freed, since the mappings still
+ * refer to the quanta; the whole range is cleared instead.
+ */
+static int scull_punch_hole(struct scull_dev *dev, loff_t off, loff_t len)
+{
+	struct scull_qset *dptr;
+	unsigned long index, last;
+	int quantum, qset, i, retval = 0;
+	long itemsize;
+	loff_t end, base, qstart, from, to;
+
+	if (off < 0 || len <= 0)
+		return -EINVAL;
+	end = len > LLONG_MAX - off ? LLONG_MAX : off + len;
+
+  again:
+	if (down_read_killable(&dev->sem))
+		return -ERESTARTSYS;
+	if (dev->small) {
+		/* clearing the buffer needs the device to ourselves */
+		up_read(&dev->sem);
+		if (down_write_killable(&dev->sem))
+			return -ERESTARTSYS;
+		if (!dev->small) {
+			up_write(&dev->sem);
+			goto again;
+		}
+		if (off < dev->size)
+			memset(dev->small + off, 0,
+					min(end, (loff_t)dev->size) - off);
+		up_write(&dev->sem);
+		return 0;
+	}
+	quantum = dev->quantum;
+	qset = dev->qset;
+	itemsize = (long)quantum * qset;
+
+	index = off / itemsize;
+	last = (end - 1) / itemsize;
+	for (dptr = xa_find(&dev->map->qsets, &index, last, XA_PRESENT); dptr;
+	     dptr = xa_find_after(&dev->map->qsets, &index, last, XA_PRESENT)) {
+		base = (loff_t)index * itemsize;
+		/* a qset a snapshot still has is copied before the change */
+		dptr = scull_follow_write(dev, index, false, GFP_KERNEL);
+		if (IS_ERR(dptr)) {
+			retval = PTR_ERR(dptr);
+			break;
+		}
+		for (i = 0; dptr->data && i < qset; i++) {
+			qstart = base + (loff_t)i * quantum;
+			from = max(off, qstart) - qstart;
+			to = min(end, qstart + quantum) - qstart;
+			if (from >= to || !dptr->data[i])
+				continue;
+			if (from == 0 && to == quantum &&
+					!atomic_read(&dev->vmas)) {
+				scull_free_quantum(dev, dptr->data[i]);
+				dptr->data[i] = NULL;
+				continue;
+			}
+			retval = scull_own_quantum(dev, &dptr->data[i], GFP_KERNEL);
+			if (retval)
+				break;
+			memset(dptr->data[i] + from, 0, to - from);
+		}
+		up_write(&dptr->sem);
+		if (retval)
+			break;
+	}
+
+	up_read(&dev->sem);
+	return retval;
+}
+
+/*
+ * Reserve storage for [off, off + len) ahead of time, much like
+ * fallocate with FALLOC_FL_KEEP_SIZE: the qsets and (zeroed) quanta are
+ * allocated now, so that writes there later allocate nothing. The size
+ * does not change; reserved bytes past it still read as a hole.
+ */
+static int scull_reserve(struct scull_dev *dev, loff_t off, loff_t len)
+{
+	struct scull_qset *dptr;
+	unsigned long item, last;
+	int quantum, qset, i, first_q, last_q;
+	long itemsize;
+	loff_t end, base;
+	int retval = 0;
+
+	if (off < 0 || len <= 0)
+		return -EINVAL;
+	end = len > LLONG_MAX - off ? LLONG_MAX : off + len;
+
+	/* reserving means quanta, so a small device is moved to them */
+	if (down_write_killable(&dev->sem))
+		return -ERESTARTSYS;
+	retval = scull_promote(dev);
+	downgrade_write(&dev->sem);
+	quantum = dev->quantum;
+	qset = dev->qset;
+	itemsize = (long)quantum * qset;
+
+	last = (end - 1) / itemsize;
+	for (item = off / itemsize; item <= last && !retval; item++) {
+		base = (loff_t)item * itemsize;
+		dptr = scull_follow_write(dev, item, false, GFP_KERNEL);
+		if (IS_ERR(dptr)) {
+			retval = PTR_ERR(dptr);
+			break;
+		}
+
+		first_q = (max(off, base) - base) / quantum;
+		last_q = (min(end, base + itemsize) - 1 - base) / quantum;
+		retval = scull_qset_slots(dev, dptr, GFP_KERNEL);
+		for (i = first_q; !retval && i <= last_q; i++) {
+			if (dptr->data[i])
+				continue;
+			dptr->data[i] = scull_alloc_quantum(dev, GFP_KERNEL);
+			if (!dptr->data[i])
+				retval = -ENOMEM;
+		}
+		up_write(&dptr->sem);
+
+		if (!retval && fatal_signal_pending(current))
+			retval = -EINTR; /* what's there stays reserved */
+	}
+
+	up_read(&dev->sem);
+	return retval;
+}
+
+/*
+ * Copying between devices: copy_file_range() only works on regular
+ * files, so SCULL_IOCCOPY does its job for scull devices. Whole quanta
+ * are passed by reference, just like a snapshot shares them, when both
+ * devices have the same quantum and the offsets fall on its boundaries;
+ * the rest goes through the read and write methods, in the kernel.
+ *
+ * Move the quantum at "off_in" of "src" to "off_out" of "dst", if it
+ * can be done that way: returns the quantum size, 0 if it can't, or an
+ * error. One device is done with before the other is locked.
+ */
+static ssize_t scull_copy_quantum(struct scull_dev *dst, loff_t off_out,
+		struct scull_dev *src, loff_t off_in, size_t len)
+{
+	struct scull_qset *dptr;
+	unsigned long item;
+	int quantum, s_pos, q_pos;
+	void *ref = NULL;
+
+	if (down_read_killable(&src->sem))
+		return -ERESTARTSYS;
+	quantum = src->quantum;
+	/* a mapped source could still change the quantum through its PTEs */
+	if (src->small || len < quantum || off_in % quantum ||
+			off_out % quantum || off_in + quantum > src->size ||
+			atomic_read(&src->vmas)) {
+		up_read(&src->sem);
+		return 0;
 	}
-	*f_pos += count;
-	retval = count;
+	scull_locate(src, off_in, &item, &s_pos, &q_pos);
+	dptr = xa_load(&src->map->qsets, item);
+	if (dptr) {
+		/* sharing a plain quantum changes the slot that holds it */
+		down_write(&dptr->sem);
+		if (dptr->data && scull_d_share(&dptr->data[s_pos], &ref,
+					quantum, GFP_KERNEL))
+			ref = ERR_PTR(-ENOMEM);
+		up_write(&dptr->sem);
+	}
+	up_read(&src->sem);
+	if (IS_ERR(ref))
+		return PTR_ERR(ref);
 
-        /* update the size */
-	if (dev->size < *f_pos)
-		dev->size = *f_pos;
+	if (down_read_killable(&dst->sem)) {
+		dptr = ERR_PTR(-ERESTARTSYS);
+		goto drop;
+	}
+	/* mapped devices keep their quanta, as mappings refer to them */
+	if (dst->small || dst->quantum != quantum ||
+			atomic_read(&dst->vmas)) {
+		up_read(&dst->sem);
+		dptr = NULL;
+		goto drop;
+	}
+	scull_locate(dst, off_out, &item, &s_pos, &q_pos);
+	dptr = scull_follow_write(dst, item, false, GFP_KERNEL);
+	if (IS_ERR(dptr)) {
+		up_read(&dst->sem);
+		goto drop;
+	}
+	if (scull_qset_slots(dst, dptr, GFP_KERNEL)) {
+		up_write(&dptr->sem);
+		up_read(&dst->sem);
+		dptr = ERR_PTR(-ENOMEM);
+		goto drop;
+	}
+	scull_free_quantum(dst, dptr->data[s_pos]);
+	dptr->data[s_pos] = ref;
+	if (ref) {
+		atomic_long_inc(&dst->nquanta);
+		scull_count(dst, quanta_alloc, 1);
+	}
+	if (scull_is_packed(ref)) {
+		atomic_long_inc(&dst->zip.quanta);
+		atomic_long_add(scull_packed(ref)->len, &dst->zip.packed);
+	}
+	WRITE_ONCE(dptr->atime, jiffies);
+	up_write(&dptr->sem);
+	scull_extend(dst, off_out + quantum);
+	up_read(&dst->sem);
+	return quantum;
+
+  drop:
+	if (ref)
+		scull_release_quantum(ref, quantum);
+	return PTR_ERR_OR_ZERO(dptr);
+}
 
+static long scull_copy_range(struct file *out, struct scull_copy *copy)
+{
+	struct scull_dev *dst = out->private_data, *src;
+	loff_t off_in = copy->off_in, off_out = copy->off_out, pos;
+	size_t len = copy->length, done = 0;
+	ssize_t retval = 0, got;
+	struct fd in;
+	char *buf = NULL;
+
+	if (copy->off_in > LLONG_MAX - copy->length ||
+			copy->off_out > LLONG_MAX - copy->length)
+		return -EINVAL;
+	in = fdget(copy->fd_in);
+	if (!in.file)
+		return -EBADF;
+	retval = -EINVAL;
+	/* bare devices, access-controlled ones and snapshots: all of ours */
+	if (in.file->f_op->read_iter != scull_read_iter)
+		goto out;
+	retval = -EBADF;
+	if (!(in.file->f_mode & FMODE_READ))
+		goto out;
+	src = in.file->private_data;
+	retval = -EINVAL;
+	if (src == dst && off_in < off_out + len && off_out < off_in + len)
+		goto out; /* overlapping */
+
+	retval = 0;
+	while (done < len) {
+		got = scull_copy_quantum(dst, off_out, src, off_in, len - done);
+		if (got == 0) {
+			/* not by reference: a page at a time, through a buffer */
+			retval = -ENOMEM;
+			if (!buf)
+				buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+			if (!buf)
+				break;
+			pos = off_in;
+			got = kernel_read(in.file, buf,
+					min_t(size_t, len - done, PAGE_SIZE), &pos);
+			if (got > 0)
+				got = kernel_write(out, buf, got, &off_out);
+			if (got > 0)
+				off_in += got;
+		} else if (got > 0) {
+			off_in += got;
+			off_out += got;
+		}
+		if (got <= 0) {
+			retval = got;
+			break;
+		}
+		done += got;
+		if (fatal_signal_pending(current))
+			break;
+		cond_resched();
+	}
+	kfree(buf);
+	if (done)
+		retval = done;
   out:
-	mutex_unlock(&dev->lock);
+	fdput(in);
 	return retval;
 }
 
@@ -397,6 +1692,12 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 
 	int err = 0, tmp;
 	int retval = 0;
+	struct scull_dev *dev = filp->private_data;
+	struct scull_range range;
+	struct scull_usage usage;
+	struct scull_zstat zstat;
+	struct scull_dstat dstat;
+	struct scull_copy copy;
     
 	/*
 	 * extract the type and number bitfields, and don't decode
@@ -507,6 +1808,114 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	  case SCULL_P_IOCQSIZE:
 		return scull_p_buffer;
 
+        /*
+         * From here on, the commands act on one bare device, so they
+         * are not passed on by scullpipe.
+         */
+
+	  case SCULL_IOCPUNCH:
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		if (copy_from_user(&range, (void __user *)arg, sizeof(range)))
+			return -EFAULT;
+		if (range.offset > LLONG_MAX || range.length > LLONG_MAX)
+			return -EINVAL;
+		return scull_punch_hole(dev, range.offset, range.length);
+
+	  case SCULL_IOCRESERVE:
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		if (copy_from_user(&range, (void __user *)arg, sizeof(range)))
+			return -EFAULT;
+		if (range.offset > LLONG_MAX || range.length > LLONG_MAX)
+			return -EINVAL;
+		return scull_reserve(dev, range.offset, range.length);
+
+	  case SCULL_IOCGUSAGE:
+		if (down_read_killable(&dev->sem))
+			return -ERESTARTSYS;
+		memset(&usage, 0, sizeof(usage));
+		usage.size = READ_ONCE(dev->size);
+		usage.reserved = (__u64)atomic_long_read(&dev->nquanta) *
+			dev->quantum;
+		usage.footprint = scull_footprint(dev);
+		up_read(&dev->sem);
+		if (copy_to_user((void __user *)arg, &usage, sizeof(usage)))
+			return -EFAULT;
+		break;
+
+	  case SCULL_IOCTZIP:
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		if (arg > UINT_MAX)
+			return -EINVAL;
+		return scull_z_set(dev, arg);
+
+	  case SCULL_IOCGZIP:
+		if (down_read_killable(&dev->sem))
+			return -ERESTARTSYS;
+		memset(&zstat, 0, sizeof(zstat));
+		zstat.raw = (__u64)atomic_long_read(&dev->zip.quanta) *
+			dev->quantum;
+		zstat.packed = atomic_long_read(&dev->zip.packed);
+		zstat.saved = zstat.raw - zstat.packed;
+		zstat.nsecs = atomic64_read(&dev->zip.nsecs);
+		up_read(&dev->sem);
+		if (copy_to_user((void __user *)arg, &zstat, sizeof(zstat)))
+			return -EFAULT;
+		break;
+
+	  case SCULL_IOCTDEDUP:
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		WRITE_ONCE(dev->dedup.on, !!arg);
+		break;
+
+	  case SCULL_IOCGDEDUP:
+		memset(&dstat, 0, sizeof(dstat));
+		dstat.hashed = atomic_long_read(&dev->dedup.hashed);
+		dstat.hits = atomic_long_read(&dev->dedup.hits);
+		dstat.zero = atomic_long_read(&dev->dedup.zero);
+		dstat.cows = atomic_long_read(&dev->dedup.cows);
+		if (copy_to_user((void __user *)arg, &dstat, sizeof(dstat)))
+			return -EFAULT;
+		break;
+
+	  case SCULL_IOCSNAP:
+		if (!(filp->f_mode & FMODE_READ))
+			return -EBADF;
+		return scull_snap_create(filp);
+
+	  case SCULL_IOCCOPY:
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		if (copy_from_user(&copy, (void __user *)arg, sizeof(copy)))
+			return -EFAULT;
+		return scull_copy_range(filp, &copy);
+
+	  case SCULL_IOCTNUMA: /* for new quanta; the others stay put */
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		if ((long)arg < INT_MIN || (long)arg > INT_MAX ||
+				!scull_numa_valid((long)arg))
+			return -EINVAL;
+		WRITE_ONCE(dev->node, (long)arg);
+		break;
+
+	  case SCULL_IOCGNUMA: /* may be negative: not a return value */
+		retval = __put_user(READ_ONCE(dev->node), (int __user *)arg);
+		break;
+
+	  case SCULL_IOCSAVE:
+		if (!(filp->f_mode & FMODE_READ))
+			return -EBADF;
+		return scull_b_ioctl(dev, cmd, arg);
+
+	  case SCULL_IOCLOAD:
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		return scull_b_ioctl(dev, cmd, arg);
+
 
 	  default:  /* redundant, as cmd was checked against MAXNR */
 		return -ENOTTY;
@@ -518,9 +1927,57 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 
 
 /*
- * The "extended" operations -- only seek
+ * The "extended" operations -- seek and mmap
  */
 
+/*
+ * Find the first data (SEEK_DATA) or hole (SEEK_HOLE) byte at or after
+ * "off". Data is any allocated quantum, whatever it holds; the end of
+ * the device counts as a hole. Called with the device semaphore held.
+ */
+loff_t scull_seek_hole_data(struct scull_dev *dev, loff_t off, int whence)
+{
+	struct scull_qset *dptr;
+	loff_t size = READ_ONCE(dev->size), pos = off, base;
+	int quantum = dev->quantum, qset = dev->qset;
+	long itemsize = (long)quantum * qset;
+	unsigned long item;
+	int i, present;
+
+	if (off < 0 || off >= size)
+		return -ENXIO;
+	if (dev->small) /* all data, up to the end */
+		return whence == SEEK_DATA ? off : size;
+
+	while (pos < size) {
+		item = pos / itemsize;
+		base = (loff_t)item * itemsize;
+		dptr = xa_load(&dev->map->qsets, item);
+		if (!dptr) {
+			if (whence == SEEK_HOLE)
+				return pos;
+			/* skip straight to the next item that exists */
+			if (!xa_find_after(&dev->map->qsets, &item, ULONG_MAX,
+						XA_PRESENT))
+				break;
+			pos = (loff_t)item * itemsize;
+			continue;
+		}
+
+		down_read(&dptr->sem);
+		for (i = (pos - base) / quantum; i < qset && pos < size; i++) {
+			present = dptr->data && dptr->data[i];
+			if (present == (whence == SEEK_DATA)) {
+				up_read(&dptr->sem);
+				return pos;
+			}
+			pos = base + (loff_t)(i + 1) * quantum;
+		}
+		up_read(&dptr->sem);
+	}
+	return whence == SEEK_HOLE ? size : -ENXIO;
+}
+
 loff_t scull_llseek(struct file *filp, loff_t off, int whence)
 {
 	struct scull_dev *dev = filp->private_data;
@@ -539,6 +1996,16 @@ loff_t scull_llseek(struct file *filp, loff_t off, int whence)
 		newpos = dev->size + off;
 		break;
 
+	  case SEEK_DATA:
+	  case SEEK_HOLE:
+		if (down_read_killable(&dev->sem))
+			return -ERESTARTSYS;
+		newpos = scull_seek_hole_data(dev, off, whence);
+		up_read(&dev->sem);
+		if (newpos < 0)
+			return newpos;
+		break;
+
 	  default: /* can't happen */
 		return -EINVAL;
 	}
@@ -548,12 +2015,132 @@ loff_t scull_llseek(struct file *filp, loff_t off, int whence)
 }
 
 
+/*
+ * Memory mapping, in the spirit of scullp: nothing is mapped up front,
+ * the fault handler hands out the quantum pages one at a time.
+ */
+
+static void scull_vma_open(struct vm_area_struct *vma)
+{
+	struct scull_dev *dev = vma->vm_private_data;
+
+	atomic_inc(&dev->vmas);
+}
+
+static void scull_vma_close(struct vm_area_struct *vma)
+{
+	struct scull_dev *dev = vma->vm_private_data;
+
+	atomic_dec(&dev->vmas);
+}
+
+/*
+ * Map the page backing the faulting offset. Holes within the device
+ * are filled with a fresh (zeroed) quantum, so that MAP_SHARED stores
+ * land in the same memory read() returns; beyond the end of the data
+ * there is nothing to map, just like a regular file.
+ */
+static vm_fault_t scull_vma_fault(struct vm_fault *vmf)
+{
+	struct scull_dev *dev = vmf->vma->vm_private_data;
+	struct scull_qset *dptr;
+	loff_t off = (loff_t)vmf->pgoff << PAGE_SHIFT;
+	unsigned long item;
+	int s_pos, q_pos;
+	vm_fault_t retval = VM_FAULT_SIGBUS;
+
+	down_read(&dev->sem);
+	if (off >= READ_ONCE(dev->size) || !scull_quantum_paged(dev->quantum))
+		goto out;
+	scull_locate(dev, off, &item, &s_pos, &q_pos);
+
+	retval = VM_FAULT_OOM;
+	dptr = scull_follow(dev, item, GFP_KERNEL);
+	if (!dptr)
+		goto out;
+
+	/* the common case, a quantum that is already there, only reads */
+	down_read(&dptr->sem);
+	WRITE_ONCE(dptr->atime, jiffies);
+	if (refcount_read(&dptr->ref) == 1 && dptr->data &&
+			dptr->data[s_pos] && scull_is_plain(dptr->data[s_pos]))
+		goto map;
+	up_read(&dptr->sem);
+
+	/* a hole, or a quantum not our own: that changes the qset */
+	dptr = scull_follow_write(dev, item, false, GFP_KERNEL);
+	if (IS_ERR(dptr)) {
+		if (PTR_ERR(dptr) != -ENOMEM)
+			retval = VM_FAULT_SIGBUS;
+		goto out;
+	}
+	if (scull_qset_slots(dev, dptr, GFP_KERNEL))
+		goto out_qset;
+	if (!dptr->data[s_pos]) {
+		dptr->data[s_pos] = scull_alloc_quantum(dev, GFP_KERNEL);
+		if (!dptr->data[s_pos])
+			goto out_qset;
+	} else if (scull_own_quantum(dev, &dptr->data[s_pos], GFP_KERNEL)) {
+		goto out_qset;
+	}
+	downgrade_write(&dptr->sem);
+
+  map:
+	vmf->page = virt_to_page(dptr->data[s_pos] + q_pos);
+	get_page(vmf->page);
+	up_read(&dptr->sem);
+	up_read(&dev->sem);
+	return 0;
+
+  out_qset:
+	up_write(&dptr->sem);
+  out:
+	up_read(&dev->sem);
+	return retval;
+}
+
+static const struct vm_operations_struct scull_vm_ops = {
+	.open =     scull_vma_open,
+	.close =    scull_vma_close,
+	.fault =    scull_vma_fault,
+};
+
+int scull_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct scull_dev *dev = filp->private_data;
+	int retval;
+
+	/* only page-aligned quanta have pages of their own */
+	if (!scull_quantum_paged(dev->quantum))
+		return -ENODEV;
+
+	/*
+	 * Small data has no pages to map: move it to quanta, and count
+	 * the mapping before anybody can write a small device again.
+	 */
+	if (down_write_killable(&dev->sem))
+		return -ERESTARTSYS;
+	retval = scull_promote(dev);
+	if (!retval) {
+		vma->vm_ops = &scull_vm_ops;
+		vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+		vma->vm_private_data = dev;
+		scull_vma_open(vma);
+	}
+	up_write(&dev->sem);
+	return retval;
+}
+
+
 
 struct file_operations scull_fops = {
 	.owner =    THIS_MODULE,
 	.llseek =   scull_llseek,
-	.read =     scull_read,
-	.write =    scull_write,
+	.read_iter = scull_read_iter,
+	.write_iter = scull_write_iter,
+	.splice_read = scull_splice_read,
+	.splice_write = iter_file_splice_write,
+	.mmap =     scull_mmap,
 	.unlocked_ioctl = scull_ioctl,
 	.open =     scull_open,
 	.release =  scull_release,
@@ -573,11 +2160,16 @@ void scull_cleanup_module(void)
 	int i;
 	dev_t devno = MKDEV(scull_major, scull_minor);
 
+	/* nothing if the module never came up */
+	if (scull_devices)
+		scull_b_save_all(scull_devices, scull_nr_devs);
+
 	/* Get rid of our char dev entries */
 	if (scull_devices) {
 		for (i = 0; i < scull_nr_devs; i++) {
-			scull_trim(scull_devices + i);
-			cdev_del(&scull_devices[i].cdev);
+			if (scull_devices[i].cdev.ops)
+				cdev_del(&scull_devices[i].cdev);
+			scull_dev_cleanup(scull_devices + i);
 		}
 		kfree(scull_devices);
 	}
@@ -592,12 +2184,22 @@ void scull_cleanup_module(void)
 	/* and call the cleanup functions for friend devices */
 	scull_p_cleanup();
 	scull_access_cleanup();
+	scull_dyn_cleanup();
 
+	/* the files went with their devices: only the directory is left */
+	debugfs_remove_recursive(scull_debugfs);
+	scull_debugfs = NULL;
+
+	/* the data went to the workqueue: wait for it all to be freed */
+	if (scull_free_wq)
+		destroy_workqueue(scull_free_wq);
+	scull_z_cleanup();
 }
 
 
 /*
- * Set up the char_dev structure for this device.
+ * Set up the char_dev structure for this device. The cdev ops stay
+ * NULL unless it was added, so that the cleanup knows what to delete.
  */
 static void scull_setup_cdev(struct scull_dev *dev, int index)
 {
@@ -608,8 +2210,11 @@ static void scull_setup_cdev(struct scull_dev *dev, int index)
 	dev->cdev.ops = &scull_fops;
 	err = cdev_add (&dev->cdev, devno, 1);
 	/* Fail gracefully if need be */
-	if (err)
+	if (err) {
 		printk(KERN_NOTICE "Error %d adding scull%d", err, index);
+		kobject_put(&dev->cdev.kobj);
+		dev->cdev.ops = NULL;
+	}
 }
 
 
@@ -646,18 +2251,40 @@ int scull_init_module(void)
 	}
 	memset(scull_devices, 0, scull_nr_devs * sizeof(struct scull_dev));
 
+	scull_d_init();
+
+	/* trims hand their data over to this one */
+	scull_free_wq = alloc_workqueue("scull_free", WQ_UNBOUND, 0);
+	if (!scull_free_wq) {
+		result = -ENOMEM;
+		goto fail;
+	}
+
         /* Initialize each device. */
 	for (i = 0; i < scull_nr_devs; i++) {
-		scull_devices[i].quantum = scull_quantum;
-		scull_devices[i].qset = scull_qset;
-		mutex_init(&scull_devices[i].lock);
-		scull_setup_cdev(&scull_devices[i], i);
+		char name[16];
+
+		result = scull_dev_init(&scull_devices[i]);
+		if (result)
+			goto fail;
+		snprintf(name, sizeof(name), "scull%d", i);
+		scull_dev_setup(&scull_devices[i],
+				i < scull_order_nr ? scull_order[i] : -1, name);
 	}
 
+	/* bring back what was saved at unload, then let users in */
+	scull_b_load_all(scull_devices, scull_nr_devs);
+	for (i = 0; i < scull_nr_devs; i++)
+		scull_setup_cdev(&scull_devices[i], i);
+	scull_create_debugfs();
+
         /* At this point call the init function for any friend device */
 	dev = MKDEV(scull_major, scull_minor + scull_nr_devs);
 	dev += scull_p_init(dev);
 	dev += scull_access_init(dev);
+	/* the on-demand devices have a major of their own */
+	if (scull_dyn_init())
+		printk(KERN_WARNING "scull: no scullctl, no sculldN devices\n");
 
 #ifdef SCULL_DEBUG /* only when debugging */
 	scull_create_proc();
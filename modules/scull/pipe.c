@@ -19,6 +19,9 @@
 
 #include <linux/kernel.h>	/* printk(), min() */
 #include <linux/slab.h>		/* kmalloc() */
+#include <linux/mm.h>		/* vm_operations_struct */
+#include <linux/vmalloc.h>	/* vmalloc_user() */
+#include <linux/capability.h>
 #include <linux/fs.h>		/* everything... */
 #include <linux/proc_fs.h>
 #include <linux/errno.h>	/* error codes */
@@ -26,36 +29,75 @@
 #include <linux/fcntl.h>
 #include <linux/poll.h>
 #include <linux/cdev.h>
+#include <linux/uio.h>		/* struct iov_iter */
 #include <asm/uaccess.h>
 #include <linux/sched.h>
 #include <linux/sched/signal.h>
 #include <linux/seq_file.h>
+#include <linux/wait_bit.h>	/* wait_on_bit_lock() */
+#include <linux/log2.h>		/* roundup_pow_of_two() */
 
 #include "scull.h"		/* local definitions */
+#include "scull_trace.h"
 
+/*
+ * The ring is a power of two long, so that head and tail run free and
+ * are masked to index it, with no modulo and no slot kept empty. The
+ * writer alone moves head, the reader alone moves tail; each publishes
+ * its move with a release store, and the other reads it with an
+ * acquire load. A reader and a writer thus never wait for each other:
+ * readers only exclude other readers (and writers other writers) with
+ * a bit lock, a single atomic when they are alone, as in the common
+ * one-writer, one-reader pipe. The mutex covers open and release, and
+ * mappings against resizing; it is never held across a user copy.
+ *
+ * The indices live in a page of their own, struct scull_ring, which
+ * can be mapped along with the ring (scull_p_mmap): then a process may
+ * take the place of the reader or the writer without system calls.
+ * As it may store anything there, the indices are never trusted to be
+ * less than a ring apart.
+ *
+ * In packet mode each write() is one record, stored whole behind its
+ * length, and each read() takes one, dropping what does not fit like a
+ * datagram socket does. Records are padded so that a length header is
+ * aligned, and never wraps around the end of the ring.
+ */
 struct scull_pipe {
         wait_queue_head_t inq, outq;       /* read and write queues */
-        char *buffer, *end;                /* begin of buf, end of buf */
-        int buffersize;                    /* used in pointer arithmetic */
-        char *rp, *wp;                     /* where to read, where to write */
+        char *buffer;                      /* the ring */
+        unsigned int size;                 /* its length, a power of two */
+        struct scull_ring *ring;           /* head and tail */
+        atomic_t vmas;                     /* mappings of either */
+        unsigned long busy;                /* SCULL_P_READING, _WRITING */
+        unsigned int grow;                 /* grow up to this size, 0 = never */
+        unsigned int stalls;               /* writers blocked since last growth */
+        unsigned int packet;               /* largest record, 0 = bytes */
         int nreaders, nwriters;            /* number of openings for r/w */
         struct fasync_struct *async_queue; /* asynchronous readers */
-        struct mutex lock;              /* mutual exclusion mutex */
+        struct mutex lock;                 /* open, release, vmas */
         struct cdev cdev;                  /* Char device structure */
 };
 
+#define SCULL_P_READING 0	/* bits in busy */
+#define SCULL_P_WRITING 1
+
+#define SCULL_P_STALLS 4	/* writers that blocked before the ring grows */
+
 /* parameters */
 static int scull_p_nr_devs = SCULL_P_NR_DEVS;	/* number of pipe devices */
 int scull_p_buffer =  SCULL_P_BUFFER;	/* buffer size */
+static int scull_p_max = 1 << 20;	/* largest ring, unless privileged */
+static int scull_p_grow;		/* default growth cap, 0 = none */
 dev_t scull_p_devno;			/* Our first device number */
 
 module_param(scull_p_nr_devs, int, 0);	/* FIXME check perms */
 module_param(scull_p_buffer, int, 0);
+module_param(scull_p_max, int, S_IRUGO);
+module_param(scull_p_grow, int, S_IRUGO);
 
 static struct scull_pipe *scull_p_devices;
 
 static int scull_p_fasync(int fd, struct file *filp, int mode);
-static int spacefree(struct scull_pipe *dev);
 /*
  * Open and close
  */
@@ -71,16 +113,25 @@ static int scull_p_open(struct inode *inode, struct file *filp)
 	if (mutex_lock_interruptible(&dev->lock))
 		return -ERESTARTSYS;
 	if (!dev->buffer) {
-		/* allocate the buffer */
-		dev->buffer = kmalloc(scull_p_buffer, GFP_KERNEL);
-		if (!dev->buffer) {
+		/* allocate the buffer, rounded up to a power of two */
+		dev->size = roundup_pow_of_two(clamp(scull_p_buffer, 2,
+					INT_MAX / 2 + 1));
+		dev->buffer = vmalloc_user(dev->size);
+		dev->ring = vmalloc_user(PAGE_SIZE); /* zeroed: */
+		if (!dev->buffer || !dev->ring) {
+			vfree(dev->buffer);
+			vfree(dev->ring);
+			dev->buffer = NULL;
+			dev->ring = NULL;
 			mutex_unlock(&dev->lock);
 			return -ENOMEM;
 		}
+		/* rd and wr from the beginning; later openers join in */
+		dev->ring->size = dev->size;
+		dev->grow = scull_p_grow;
+		dev->stalls = 0;
+		dev->packet = 0;
 	}
-	dev->buffersize = scull_p_buffer;
-	dev->end = dev->buffer + dev->buffersize;
-	dev->rp = dev->wp = dev->buffer; /* rd and wr from the beginning */
 
 	/* use f_mode,not  f_flags: it's cleaner (fs/open.c tells why) */
 	if (filp->f_mode & FMODE_READ)
@@ -89,6 +140,7 @@ static int scull_p_open(struct inode *inode, struct file *filp)
 		dev->nwriters++;
 	mutex_unlock(&dev->lock);
 
+	filp->f_mode |= FMODE_NOWAIT; /* read_iter/write_iter honor IOCB_NOWAIT */
 	return nonseekable_open(inode, filp);
 }
 
@@ -106,7 +158,9 @@ static int scull_p_release(struct inode *inode, struct file *filp)
 	if (filp->f_mode & FMODE_WRITE)
 		dev->nwriters--;
 	if (dev->nreaders + dev->nwriters == 0) {
-		kfree(dev->buffer);
+		vfree(dev->buffer);	/* not mapped: mappings hold the file */
+		vfree(dev->ring);
+		dev->ring = NULL;
 		dev->buffer = NULL; /* the other fields are not checked on open */
 	}
 	mutex_unlock(&dev->lock);
@@ -118,137 +172,620 @@ static int scull_p_release(struct inode *inode, struct file *filp)
  * Data management: read and write
  */
 
-static ssize_t scull_p_read (struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+/*
+ * A request must not sleep if the file is non-blocking or if the
+ * caller (io_uring, RWF_NOWAIT) asked for IOCB_NOWAIT.
+ */
+static inline int scull_p_nowait(struct kiocb *iocb)
 {
-	struct scull_pipe *dev = filp->private_data;
+	return (iocb->ki_filp->f_flags & O_NONBLOCK) ||
+		(iocb->ki_flags & IOCB_NOWAIT);
+}
 
-	if (mutex_lock_interruptible(&dev->lock))
+/*
+ * Take our side of the pipe, "bit" being SCULL_P_READING or _WRITING.
+ * Others on the same side sleep until it is released; nobody sleeps
+ * holding it, save to take the other bit while resizing.
+ */
+static int scull_p_lock(struct scull_pipe *dev, int bit, bool nowait)
+{
+	if (!test_and_set_bit_lock(bit, &dev->busy))
+		return 0;
+	if (nowait)
+		return -EAGAIN;
+	if (wait_on_bit_lock(&dev->busy, bit, TASK_INTERRUPTIBLE))
 		return -ERESTARTSYS;
+	return 0;
+}
+
+static void scull_p_unlock(struct scull_pipe *dev, int bit)
+{
+	clear_bit_unlock(bit, &dev->busy);
+	smp_mb__after_atomic();
+	wake_up_bit(&dev->busy, bit);
+}
+
+/*
+ * Bytes to read and room to write. Each side reads the other's index
+ * with acquire, so that what the other side wrote before moving it is
+ * seen; a mapping may have scrambled them, hence the min().
+ */
+static unsigned int scull_p_used(struct scull_pipe *dev)
+{
+	return min(smp_load_acquire(&dev->ring->head) -
+			READ_ONCE(dev->ring->tail), dev->size);
+}
+
+static unsigned int spacefree(struct scull_pipe *dev)
+{
+	return dev->size - min(READ_ONCE(dev->ring->head) -
+			smp_load_acquire(&dev->ring->tail), dev->size);
+}
+
+/*
+ * Wake the other side, if it sleeps: in the kernel, or in user space
+ * as told by its flag in the ring. The barrier orders our index update
+ * before the checks, against the one sleepers have before theirs.
+ */
+static inline void scull_p_wake(wait_queue_head_t *q, __u32 *waits)
+{
+	smp_mb();
+	if (READ_ONCE(*waits))
+		WRITE_ONCE(*waits, 0);
+	if (waitqueue_active(q))
+		wake_up_interruptible(q);
+}
+
+/* ... and the sleeper's side, before it checks a last time */
+static inline void scull_p_wait(__u32 *waits)
+{
+	WRITE_ONCE(*waits, 1);
+	smp_mb();
+}
+
+/*
+ * Move "count" bytes out of or into the ring from index "pos", in two
+ * pieces when they wrap around its end; returns how much was copied.
+ */
+static size_t scull_p_copy_out(struct scull_pipe *dev, unsigned int pos,
+		size_t count, struct iov_iter *to)
+{
+	unsigned int off = pos & (dev->size - 1);
+	size_t first = min(count, (size_t)(dev->size - off)), done;
+
+	done = copy_to_iter(dev->buffer + off, first, to);
+	if (done == first && count > first)
+		done += copy_to_iter(dev->buffer, count - first, to);
+	return done;
+}
+
+static size_t scull_p_copy_in(struct scull_pipe *dev, unsigned int pos,
+		size_t count, struct iov_iter *from)
+{
+	unsigned int off = pos & (dev->size - 1);
+	size_t first = min(count, (size_t)(dev->size - off)), done;
+
+	done = copy_from_iter(dev->buffer + off, first, from);
+	if (done == first && count > first)
+		done += copy_from_iter(dev->buffer, count - first, from);
+	return done;
+}
+
+/*
+ * The same for a record: its header always fits before the end of the
+ * ring, being aligned. A mapped producer may have stored anything, so
+ * the header is checked before being believed.
+ */
+static ssize_t scull_p_put(struct scull_pipe *dev, struct iov_iter *from)
+{
+	unsigned int head = READ_ONCE(dev->ring->head);
+	size_t count = iov_iter_count(from);
+
+	if (head & 3)
+		return -EIO;
+	*(__u32 *)(dev->buffer + (head & (dev->size - 1))) = count;
+	if (scull_p_copy_in(dev, head + 4, count, from) != count)
+		return -EFAULT;	/* not published: the record is not there */
+	smp_store_release(&dev->ring->head, head + SCULL_REC_SIZE(count));
+	return count;
+}
 
-	while (dev->rp == dev->wp) { /* nothing to read */
-		mutex_unlock(&dev->lock); /* release the lock */
-		if (filp->f_flags & O_NONBLOCK)
+/* Take the record at tail into "to"; *len is set to its full length */
+static ssize_t scull_p_take(struct scull_pipe *dev, struct iov_iter *to,
+		size_t *len)
+{
+	unsigned int used = scull_p_used(dev);
+	unsigned int tail = READ_ONCE(dev->ring->tail);
+	size_t count;
+	__u32 n;
+
+	if ((tail & 3) || used < SCULL_REC_SIZE(0))
+		return -EIO;
+	n = READ_ONCE(*(__u32 *)(dev->buffer + (tail & (dev->size - 1))));
+	if (n > dev->packet || SCULL_REC_SIZE(n) > used)
+		return -EIO;
+	count = min(iov_iter_count(to), (size_t)n);
+	if (scull_p_copy_out(dev, tail + 4, count, to) != count)
+		return -EFAULT;	/* left for the next try */
+	smp_store_release(&dev->ring->tail, tail + SCULL_REC_SIZE(n));
+	*len = n;
+	return count;
+}
+
+/*
+ * Wait for data; caller must hold the reading bit. On error the bit is
+ * released before returning.
+ */
+static int scull_getdata(struct scull_pipe *dev, bool nowait)
+{
+	u64 slept;
+	int result;
+
+	while (!scull_p_used(dev)) { /* nothing to read */
+		scull_p_unlock(dev, SCULL_P_READING); /* release the lock */
+		if (nowait)
 			return -EAGAIN;
-		PDEBUG("\"%s\" reading: going to sleep\n", current->comm);
-		if (wait_event_interruptible(dev->inq, (dev->rp != dev->wp)))
-			return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
+		trace_scull_p_sleep(dev->cdev.dev, 0);
+		slept = scull_trace_start(scull_p_wakeup);
+		scull_p_wait(&dev->ring->reader_waits);
+		result = wait_event_interruptible(dev->inq, scull_p_used(dev));
+		trace_scull_p_wakeup(dev->cdev.dev, 0, result, slept);
+		if (result)
+			return result; /* signal: tell the fs layer to handle it */
 		/* otherwise loop, but first reacquire the lock */
-		if (mutex_lock_interruptible(&dev->lock))
-			return -ERESTARTSYS;
+		result = scull_p_lock(dev, SCULL_P_READING, false);
+		if (result)
+			return result;
 	}
-	/* ok, data is there, return something */
-	if (dev->wp > dev->rp)
-		count = min(count, (size_t)(dev->wp - dev->rp));
-	else /* the write pointer has wrapped, return data up to dev->end */
-		count = min(count, (size_t)(dev->end - dev->rp));
-	if (copy_to_user(buf, dev->rp, count)) {
-		mutex_unlock (&dev->lock);
-		return -EFAULT;
-	}
-	dev->rp += count;
-	if (dev->rp == dev->end)
-		dev->rp = dev->buffer; /* wrapped */
-	mutex_unlock (&dev->lock);
+	return 0;
+}
+
+static ssize_t scull_p_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct scull_pipe *dev = iocb->ki_filp->private_data;
+	size_t asked = iov_iter_count(to), count = asked;
+	u64 start = scull_trace_start(scull_p_read);
+	unsigned int tail;
+	loff_t at = 0;
+	ssize_t result;
+
+	if (!count)
+		return 0;
+	result = scull_p_lock(dev, SCULL_P_READING,
+			iocb->ki_flags & IOCB_NOWAIT);
+	if (result)
+		goto out;
+	result = scull_getdata(dev, scull_p_nowait(iocb));
+	if (result)
+		goto out; /* scull_getdata released the lock */
 
+	tail = READ_ONCE(dev->ring->tail);
+	at = tail & (dev->size - 1);
+	if (dev->packet) {
+		result = scull_p_take(dev, to, &count);
+		goto unlock;
+	}
+	/* ok, data is there, return all of it that fits, wrapped or not */
+	count = min(count, (size_t)scull_p_used(dev));
+	count = scull_p_copy_out(dev, tail, count, to);
+	result = -EFAULT;
+	if (!count)
+		goto unlock;
+	/* the writer may reuse the space once it sees this */
+	smp_store_release(&dev->ring->tail, tail + count);
+	result = count;
+
+  unlock:
+	scull_p_unlock(dev, SCULL_P_READING);
 	/* finally, awake any writers and return */
-	wake_up_interruptible(&dev->outq);
-	PDEBUG("\"%s\" did read %li bytes\n",current->comm, (long)count);
-	return count;
+	if (result > 0)
+		scull_p_wake(&dev->outq, &dev->ring->writer_waits);
+  out:
+	trace_scull_p_read(dev->cdev.dev, at, asked, result, start);
+	return result;
 }
 
-/* Wait for space for writing; caller must hold device semaphore.  On
- * error the semaphore will be released before returning. */
-static int scull_getwritespace(struct scull_pipe *dev, struct file *filp)
+/*
+ * Give the ring a new size, keeping what it holds; called with both
+ * bits held. It cannot shrink below what is unread.
+ */
+static int scull_p_resize(struct scull_pipe *dev, unsigned int size)
 {
-	while (spacefree(dev) == 0) { /* full */
-		DEFINE_WAIT(wait);
-		
+	unsigned int used = scull_p_used(dev);
+	unsigned int off = READ_ONCE(dev->ring->tail) & (dev->size - 1);
+	unsigned int first = min(used, dev->size - off);
+	char *buffer;
+
+	if (size < used)
+		return -EBUSY;
+	if (dev->packet && size < SCULL_REC_SIZE(dev->packet))
+		return -EINVAL;
+	if (size == dev->size)
+		return 0;
+	buffer = vmalloc_user(size);
+	if (!buffer)
+		return -ENOMEM;
+
+	/* no mapping may come or be there: it would not see the move */
+	mutex_lock(&dev->lock);
+	if (atomic_read(&dev->vmas)) {
 		mutex_unlock(&dev->lock);
-		if (filp->f_flags & O_NONBLOCK)
+		vfree(buffer);
+		return -EBUSY;
+	}
+	memcpy(buffer, dev->buffer + off, first);
+	memcpy(buffer + first, dev->buffer, used - first);
+	vfree(dev->buffer);
+	dev->buffer = buffer;
+	dev->size = size;
+	WRITE_ONCE(dev->ring->size, size);
+	WRITE_ONCE(dev->ring->tail, 0);
+	WRITE_ONCE(dev->ring->head, used);
+	mutex_unlock(&dev->lock);
+	return 0;
+}
+
+/*
+ * A writer is about to block: if writers keep doing so, and the pipe
+ * may grow, double the ring instead. The reader is only waited for if
+ * idle, as taking its bit the other way round could deadlock against
+ * scull_p_ring().
+ */
+static int scull_p_autogrow(struct scull_pipe *dev)
+{
+	int result;
+
+	if (!dev->grow || dev->size > dev->grow / 2 ||
+			++dev->stalls < SCULL_P_STALLS)
+		return -ENOSPC;
+	if (test_and_set_bit_lock(SCULL_P_READING, &dev->busy))
+		return -EBUSY;
+	result = scull_p_resize(dev, dev->size * 2);
+	scull_p_unlock(dev, SCULL_P_READING);
+	if (!result)
+		dev->stalls = 0;
+	return result;
+}
+
+/*
+ * The room a write of "count" bytes waits for: a byte, or the whole
+ * record. A record too large for the pipe does not wait, but fails.
+ */
+static unsigned int scull_p_room(struct scull_pipe *dev, size_t count)
+{
+	unsigned int packet = READ_ONCE(dev->packet);
+
+	if (!packet)
+		return 1;
+	return count > packet ? 0 : SCULL_REC_SIZE(count);
+}
+
+/*
+ * Wait for space for writing "count" bytes; caller must hold the
+ * writing bit. On error the bit is released before returning.
+ */
+static int scull_getwritespace(struct scull_pipe *dev, struct kiocb *iocb,
+		size_t count)
+{
+	while (spacefree(dev) < scull_p_room(dev, count)) { /* full */
+		DEFINE_WAIT(wait);
+		u64 slept;
+		int result;
+
+		if (!scull_p_nowait(iocb) && !scull_p_autogrow(dev))
+			continue; /* a record may need more */
+		scull_p_unlock(dev, SCULL_P_WRITING);
+		if (scull_p_nowait(iocb))
 			return -EAGAIN;
-		PDEBUG("\"%s\" writing: going to sleep\n",current->comm);
+		trace_scull_p_sleep(dev->cdev.dev, 1);
+		slept = scull_trace_start(scull_p_wakeup);
+		scull_p_wait(&dev->ring->writer_waits);
 		prepare_to_wait(&dev->outq, &wait, TASK_INTERRUPTIBLE);
-		if (spacefree(dev) == 0)
+		if (spacefree(dev) < scull_p_room(dev, count))
 			schedule();
 		finish_wait(&dev->outq, &wait);
-		if (signal_pending(current))
-			return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
-		if (mutex_lock_interruptible(&dev->lock))
-			return -ERESTARTSYS;
+		result = signal_pending(current) ? -ERESTARTSYS : 0;
+		trace_scull_p_wakeup(dev->cdev.dev, 1, result, slept);
+		if (result)
+			return result; /* signal: tell the fs layer to handle it */
+		/* otherwise loop, but first reacquire the lock */
+		result = scull_p_lock(dev, SCULL_P_WRITING, false);
+		if (result)
+			return result;
 	}
 	return 0;
 }	
 
-/* How much space is free? */
-static int spacefree(struct scull_pipe *dev)
+/*
+ * SCULL_P_IOCTRING: resize the ring of an open pipe, like F_SETPIPE_SZ;
+ * 0 only asks for the current size. Returns the size, rounded up.
+ */
+static long scull_p_ring(struct scull_pipe *dev, unsigned long arg)
 {
-	if (dev->rp == dev->wp)
-		return dev->buffersize - 1;
-	return ((dev->rp + dev->buffersize - dev->wp) % dev->buffersize) - 1;
+	unsigned int size;
+	int result;
+
+	if (!arg)
+		return READ_ONCE(dev->size);
+	if (arg > INT_MAX / 2 + 1)
+		return -EINVAL;
+	size = roundup_pow_of_two(max(arg, 2UL));
+	if (size > scull_p_max && !capable(CAP_SYS_RESOURCE))
+		return -EPERM;
+
+	/* the reader first, then the writer: see scull_p_autogrow() */
+	result = scull_p_lock(dev, SCULL_P_READING, false);
+	if (result)
+		return result;
+	result = scull_p_lock(dev, SCULL_P_WRITING, false);
+	if (result) {
+		scull_p_unlock(dev, SCULL_P_READING);
+		return result;
+	}
+	result = scull_p_resize(dev, size);
+	scull_p_unlock(dev, SCULL_P_WRITING);
+	scull_p_unlock(dev, SCULL_P_READING);
+	if (result)
+		return result;
+	wake_up_interruptible(&dev->outq); /* there may be room now */
+	return size;
 }
 
-static ssize_t scull_p_write(struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
+static ssize_t scull_p_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-	struct scull_pipe *dev = filp->private_data;
-	int result;
-
-	if (mutex_lock_interruptible(&dev->lock))
-		return -ERESTARTSYS;
+	struct scull_pipe *dev = iocb->ki_filp->private_data;
+	size_t asked = iov_iter_count(from), count = asked;
+	u64 start = scull_trace_start(scull_p_write);
+	unsigned int head;
+	loff_t at = 0;
+	ssize_t result;
+
+	if (!count)
+		return 0;
+	result = scull_p_lock(dev, SCULL_P_WRITING,
+			iocb->ki_flags & IOCB_NOWAIT);
+	if (result)
+		goto out;
 
 	/* Make sure there's space to write */
-	result = scull_getwritespace(dev, filp);
+	result = scull_getwritespace(dev, iocb, count);
 	if (result)
-		return result; /* scull_getwritespace called up(&dev->sem) */
-
-	/* ok, space is there, accept something */
+		goto out; /* scull_getwritespace released the lock */
+
+	head = READ_ONCE(dev->ring->head);
+	at = head & (dev->size - 1);
+	if (dev->packet) {
+		result = count > dev->packet ? -EMSGSIZE :
+				scull_p_put(dev, from);
+		goto unlock;
+	}
+	/* ok, space is there, accept as much as fits, wrapping around */
 	count = min(count, (size_t)spacefree(dev));
-	if (dev->wp >= dev->rp)
-		count = min(count, (size_t)(dev->end - dev->wp)); /* to end-of-buf */
-	else /* the write pointer has wrapped, fill up to rp-1 */
-		count = min(count, (size_t)(dev->rp - dev->wp - 1));
-	PDEBUG("Going to accept %li bytes to %p from %p\n", (long)count, dev->wp, buf);
-	if (copy_from_user(dev->wp, buf, count)) {
-		mutex_unlock(&dev->lock);
-		return -EFAULT;
+	count = scull_p_copy_in(dev, head, count, from);
+	result = -EFAULT;
+	if (!count)
+		goto unlock;
+	/* the data is in before the reader sees the new head */
+	smp_store_release(&dev->ring->head, head + count);
+	result = count;
+
+  unlock:
+	scull_p_unlock(dev, SCULL_P_WRITING);
+	if (result > 0) {
+		/* finally, awake any reader */
+		scull_p_wake(&dev->inq, &dev->ring->reader_waits);
+
+		/* and signal asynchronous readers, explained late in chapter 5 */
+		if (dev->async_queue)
+			kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
 	}
-	dev->wp += count;
-	if (dev->wp == dev->end)
-		dev->wp = dev->buffer; /* wrapped */
-	mutex_unlock(&dev->lock);
-
-	/* finally, awake any reader */
-	wake_up_interruptible(&dev->inq);  /* blocked in read() and select() */
-
-	/* and signal asynchronous readers, explained late in chapter 5 */
-	if (dev->async_queue)
-		kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
-	PDEBUG("\"%s\" did write %li bytes\n",current->comm, (long)count);
-	return count;
+  out:
+	trace_scull_p_write(dev->cdev.dev, at, asked, result, start);
+	return result;
 }
 
 static unsigned int scull_p_poll(struct file *filp, poll_table *wait)
 {
 	struct scull_pipe *dev = filp->private_data;
-	unsigned int mask = 0;
+	__poll_t events = poll_requested_events(wait);
+	unsigned int mask = 0, room;
 
 	/*
-	 * The buffer is circular; it is considered full
-	 * if "wp" is right behind "rp" and empty if the
-	 * two are equal.
+	 * The buffer is circular; it is considered full if "head" is a
+	 * whole buffer ahead of "tail", and empty if the two are equal.
+	 * No lock: the answer may be stale by the time it is returned
+	 * anyway. poll_wait() is no barrier, though: without one, the
+	 * indices could be loaded before we are on the queues, and a
+	 * wakeup in between missed. The barrier pairs with the one in
+	 * scull_p_wake(), as in sock_poll_wait(). A process sleeping here
+	 * may be waiting for a peer that writes or reads through the
+	 * mapping: the flags tell that peer to wake it.
 	 */
-	mutex_lock(&dev->lock);
 	poll_wait(filp, &dev->inq,  wait);
 	poll_wait(filp, &dev->outq, wait);
-	if (dev->rp != dev->wp)
+	smp_mb();
+	if ((events & POLLIN) && !scull_p_used(dev))
+		scull_p_wait(&dev->ring->reader_waits);
+	/* in packet mode, writable means room for the largest record */
+	room = scull_p_room(dev, READ_ONCE(dev->packet));
+	if ((events & POLLOUT) && spacefree(dev) < room)
+		scull_p_wait(&dev->ring->writer_waits);
+	if (scull_p_used(dev))
 		mask |= POLLIN | POLLRDNORM;	/* readable */
-	if (spacefree(dev))
+	if (spacefree(dev) >= room)
 		mask |= POLLOUT | POLLWRNORM;	/* writable */
-	mutex_unlock(&dev->lock);
 	return mask;
 }
 
+/*
+ * SCULL_P_IOCTPACKET: switch to packet mode, with records of up to
+ * "arg" bytes, or back to a byte stream with 0. The pipe must be empty,
+ * and not mapped, as the indices start again from 0.
+ */
+static long scull_p_setpacket(struct scull_pipe *dev, unsigned long arg)
+{
+	int result;
+
+	if (arg > INT_MAX / 2)
+		return -EINVAL;
+	result = scull_p_lock(dev, SCULL_P_READING, false);
+	if (result)
+		return result;
+	result = scull_p_lock(dev, SCULL_P_WRITING, false);
+	if (result)
+		goto unlock;
+
+	result = -EINVAL; /* SCULL_P_IOCTRING first */
+	if (arg && SCULL_REC_SIZE(arg) > dev->size)
+		goto unlock_both;
+	mutex_lock(&dev->lock);	/* against new mappings */
+	result = -EBUSY;
+	if (!scull_p_used(dev) && !atomic_read(&dev->vmas)) {
+		WRITE_ONCE(dev->ring->head, 0);
+		WRITE_ONCE(dev->ring->tail, 0);
+		WRITE_ONCE(dev->ring->packet, arg);
+		WRITE_ONCE(dev->packet, arg);
+		result = 0;
+	}
+	mutex_unlock(&dev->lock);
+
+  unlock_both:
+	scull_p_unlock(dev, SCULL_P_WRITING);
+  unlock:
+	scull_p_unlock(dev, SCULL_P_READING);
+	if (!result)
+		wake_up_interruptible(&dev->outq); /* they wait for less, or fail */
+	return result;
+}
+
+/* SCULL_P_IOCRECV: see struct scull_recv */
+static long scull_p_recv(struct file *filp, struct scull_recv __user *arg)
+{
+	struct scull_pipe *dev = filp->private_data;
+	struct scull_rec __user *recs;
+	struct scull_recv rv;
+	struct scull_rec rec;
+	struct iovec iov;
+	struct iov_iter iter;
+	size_t len;
+	long result;
+	u32 i = 0;
+
+	if (!(filp->f_mode & FMODE_READ))
+		return -EBADF;
+	if (copy_from_user(&rv, arg, sizeof(rv)))
+		return -EFAULT;
+	if (rv.flags || !READ_ONCE(dev->packet))
+		return -EINVAL;
+	if (!rv.nr)
+		return 0;
+	recs = u64_to_user_ptr(rv.recs);
+
+	result = scull_p_lock(dev, SCULL_P_READING, false);
+	if (result)
+		return result;
+	result = scull_getdata(dev, filp->f_flags & O_NONBLOCK);
+	if (result)
+		return result; /* scull_getdata released the lock */
+	result = -EINVAL; /* back to bytes meanwhile */
+	if (!dev->packet)
+		goto unlock;
+
+	/* what is there already; the first error ends the batch */
+	for (; i < rv.nr && scull_p_used(dev); i++) {
+		result = -EFAULT;
+		if (copy_from_user(&rec, recs + i, sizeof(rec)))
+			break;
+		result = import_single_range(READ, u64_to_user_ptr(rec.buf),
+				rec.len, &iov, &iter);
+		if (result)
+			break;
+		result = scull_p_take(dev, &iter, &len);
+		if (result < 0)
+			break;
+		if (put_user((__u32)len, &recs[i].got)) {
+			result = -EFAULT;
+			i++;	/* taken all the same */
+			break;
+		}
+	}
+
+  unlock:
+	scull_p_unlock(dev, SCULL_P_READING);
+	if (!i)
+		return result;
+	scull_p_wake(&dev->outq, &dev->ring->writer_waits);
+	return i;
+}
+
+/*
+ * SCULL_P_IOCWAKE: a process working on the mapping moved an index and
+ * found the flag of the other side set.
+ */
+static long scull_p_kick(struct scull_pipe *dev)
+{
+	scull_p_wake(&dev->inq, &dev->ring->reader_waits);
+	scull_p_wake(&dev->outq, &dev->ring->writer_waits);
+	if (dev->async_queue && scull_p_used(dev))
+		kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+	return 0;
+}
+
+/*
+ * Mapping the pipe: the page of indices at offset 0, and the ring at
+ * SCULL_RING_OFF_DATA, which must then be a whole number of pages. A
+ * mapped ring keeps its size. Everything is mapped up front, so there
+ * is no fault handler. mmap() runs with mmap_lock held, and readers
+ * and writers may fault on user memory holding their bit: only the
+ * mutex is taken here, which nobody holds across a user copy.
+ */
+static void scull_p_vma_open(struct vm_area_struct *vma)
+{
+	struct scull_pipe *dev = vma->vm_private_data;
+
+	atomic_inc(&dev->vmas);
+}
+
+static void scull_p_vma_close(struct vm_area_struct *vma)
+{
+	struct scull_pipe *dev = vma->vm_private_data;
+
+	atomic_dec(&dev->vmas);
+}
+
+static const struct vm_operations_struct scull_p_vm_ops = {
+	.open =     scull_p_vma_open,
+	.close =    scull_p_vma_close,
+};
+
+static int scull_p_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct scull_pipe *dev = filp->private_data;
+	unsigned long off = vma->vm_pgoff << PAGE_SHIFT;
+	unsigned long len = vma->vm_end - vma->vm_start;
+	int result;
+
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	/* no resizing meanwhile */
+	if (mutex_lock_interruptible(&dev->lock))
+		return -ERESTARTSYS;
+	result = -EINVAL;
+	if (off == 0 && len <= PAGE_SIZE)
+		result = remap_vmalloc_range(vma, dev->ring, 0);
+	else if (off == SCULL_RING_OFF_DATA && !(dev->size & ~PAGE_MASK) &&
+			len <= dev->size)
+		result = remap_vmalloc_range(vma, dev->buffer, 0);
+	if (!result) {
+		vma->vm_ops = &scull_p_vm_ops;
+		vma->vm_private_data = dev;
+		scull_p_vma_open(vma);
+	}
+	mutex_unlock(&dev->lock);
+	return result;
+}
+
 
 
 
@@ -262,6 +799,44 @@ static int scull_p_fasync(int fd, struct file *filp, int mode)
 
 
 
+/*
+ * The pipe shares the ioctl method of the bare device, but only the
+ * parameter commands: the rest act on a struct scull_dev.
+ */
+static long scull_p_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct scull_pipe *dev = filp->private_data;
+
+	switch(cmd) {
+	  case SCULL_P_IOCTRING:
+		return scull_p_ring(dev, arg);
+
+	  case SCULL_P_IOCWAKE:
+		return scull_p_kick(dev);
+
+	  case SCULL_P_IOCTPACKET:
+		return scull_p_setpacket(dev, arg);
+
+	  case SCULL_P_IOCRECV:
+		return scull_p_recv(filp, (struct scull_recv __user *)arg);
+
+	  case SCULL_P_IOCTGROW: /* the limit, rounded down; 0 = never */
+		if (arg > INT_MAX / 2 + 1)
+			return -EINVAL;
+		if (arg > scull_p_max && !capable(CAP_SYS_RESOURCE))
+			return -EPERM;
+		WRITE_ONCE(dev->grow, arg ? rounddown_pow_of_two(arg) : 0);
+		return 0;
+	}
+
+	if (_IOC_TYPE(cmd) == SCULL_IOC_MAGIC &&
+			_IOC_NR(cmd) > _IOC_NR(SCULL_P_IOCQSIZE))
+		return -ENOTTY;
+	return scull_ioctl(filp, cmd, arg);
+}
+
+
+
 /* FIXME this should use seq_file */
 #ifdef SCULL_DEBUG
 
@@ -278,8 +853,12 @@ static int scull_read_p_mem(struct seq_file *s, void *v)
 			return -ERESTARTSYS;
 		seq_printf(s, "\nDevice %i: %p\n", i, p);
 /*		seq_printf(s, "   Queues: %p %p\n", p->inq, p->outq);*/
-		seq_printf(s, "   Buffer: %p to %p (%i bytes)\n", p->buffer, p->end, p->buffersize);
-		seq_printf(s, "   rp %p   wp %p\n", p->rp, p->wp);
+		seq_printf(s, "   Buffer: %p (%u bytes)\n", p->buffer, p->size);
+		if (p->packet)
+			seq_printf(s, "   Records of up to %u bytes\n", p->packet);
+		if (p->ring)
+			seq_printf(s, "   head %u   tail %u\n", p->ring->head,
+					p->ring->tail);
 		seq_printf(s, "   readers %i   writers %i\n", p->nreaders, p->nwriters);
 		mutex_unlock(&p->lock);
 	}
@@ -310,10 +889,13 @@ static struct file_operations scullpipe_proc_ops = {
 struct file_operations scull_pipe_fops = {
 	.owner =	THIS_MODULE,
 	.llseek =	no_llseek,
-	.read =		scull_p_read,
-	.write =	scull_p_write,
+	.read_iter =	scull_p_read_iter,
+	.write_iter =	scull_p_write_iter,
+	.splice_read =	generic_file_splice_read, /* the ring is reused: copy */
+	.splice_write =	iter_file_splice_write,
 	.poll =		scull_p_poll,
-	.unlocked_ioctl = scull_ioctl,
+	.mmap =		scull_p_mmap,
+	.unlocked_ioctl = scull_p_ioctl,
 	.open =		scull_p_open,
 	.release =	scull_p_release,
 	.fasync =	scull_p_fasync,
@@ -385,7 +967,8 @@ void scull_p_cleanup(void)
 
 	for (i = 0; i < scull_p_nr_devs; i++) {
 		cdev_del(&scull_p_devices[i].cdev);
-		kfree(scull_p_devices[i].buffer);
+		vfree(scull_p_devices[i].buffer);
+		vfree(scull_p_devices[i].ring);
 	}
 	kfree(scull_p_devices);
 	unregister_chrdev_region(scull_p_devno, scull_p_nr_devs);
@@ -19,6 +19,7 @@
 #define _SCULL_H_
 
 #include <linux/ioctl.h> /* needed for the _IOW etc stuff used later */
+#include <linux/types.h> /* __u64 and friends, for the ioctl structures */
 
 /*
  * Macros to help debugging
@@ -48,16 +49,19 @@
 #define SCULL_NR_DEVS 4    /* scull0 through scull3 */
 #endif
 
+#define SCULL_MAX_DEVS 16  /* per type, as NUM() has four bits */
+
 #ifndef SCULL_P_NR_DEVS
 #define SCULL_P_NR_DEVS 4  /* scullpipe0 through scullpipe3 */
 #endif
 
 /*
  * The bare device is a variable-length region of memory.
- * Use a linked list of indirect blocks.
+ * Use an indexed map of indirect blocks.
  *
- * "scull_dev->data" points to an array of pointers, each
- * pointer refers to a memory area of SCULL_QUANTUM bytes.
+ * "scull_dev->map" maps a list item number to a quantum set,
+ * which is an array of pointers, each pointer refers to a memory
+ * area of SCULL_QUANTUM bytes.
  *
  * The array (quantum-set) is SCULL_QSET long.
  */
@@ -69,6 +73,14 @@
 #define SCULL_QSET    1000
 #endif
 
+/*
+ * Devices up to this size keep their data in one small buffer, and
+ * only get quantum sets when they grow past it. 0 disables this.
+ */
+#ifndef SCULL_SMALL
+#define SCULL_SMALL   512
+#endif
+
 /*
  * The pipe device is a simple circular buffer. Here its default size
  */
@@ -81,16 +93,135 @@
  */
 struct scull_qset {
 	void **data;
-	struct scull_qset *next;
+	unsigned long atime;      /* jiffies at the last read or write */
+	refcount_t ref;           /* maps holding it: snapshots share it */
+	struct rw_semaphore sem;  /* protects data and the quanta */
+};
+
+/*
+ * A quantum pointer in a qset is not always plain memory; the low bits
+ * (free, as kmalloc aligns to at least 8) say what it refers to.
+ *
+ * A cold quantum may be kept compressed (see compress.c). Its pointer
+ * then refers to one of these, with SCULL_PACKED set.
+ */
+struct scull_packed {
+	unsigned int len;         /* compressed bytes in data[] */
+	char data[];
+};
+
+/*
+ * A quantum held in several places at once (see dedup.c) is reached
+ * through one of these, with SCULL_SHARED set. The data is read-only
+ * while shared: writers get a copy of their own first.
+ */
+struct scull_shared {
+	refcount_t ref;           /* qset slots pointing here */
+	int quantum;              /* size of data */
+	void *data;
+	u64 hash;                 /* of the contents, if in the dedup table;
+	                             it also picks the lock (dedup.c) */
+	struct hlist_node node;   /* unhashed if not */
+};
+
+#define SCULL_PACKED 1UL
+#define SCULL_SHARED 2UL
+#define SCULL_TAGS   (SCULL_PACKED | SCULL_SHARED)
+
+static inline int scull_is_plain(void *q)
+{
+	return !((unsigned long)q & SCULL_TAGS);
+}
+
+static inline int scull_is_packed(void *q)
+{
+	return (unsigned long)q & SCULL_PACKED;
+}
+
+static inline struct scull_packed *scull_packed(void *q)
+{
+	return (struct scull_packed *)((unsigned long)q & ~SCULL_PACKED);
+}
+
+static inline int scull_is_shared(void *q)
+{
+	return (unsigned long)q & SCULL_SHARED;
+}
+
+static inline struct scull_shared *scull_shared(void *q)
+{
+	return (struct scull_shared *)((unsigned long)q & ~SCULL_SHARED);
+}
+
+/*
+ * The quantum sets of a device, indexed by item number. A trim swaps
+ * the whole map for an empty one and frees the old one in the
+ * background; quantum and qset record its geometry for that.
+ */
+struct scull_map {
+	struct xarray qsets;
+	int quantum, qset;
+	struct work_struct work;
+};
+
+/*
+ * Compression state of a device: the scan that packs idle qsets, and
+ * what it achieved so far.
+ */
+struct scull_zip {
+	unsigned long after;      /* idle jiffies before packing, 0 = never */
+	struct delayed_work work; /* the periodic scan */
+	atomic_long_t quanta;     /* quanta held compressed */
+	atomic_long_t packed;     /* bytes they take compressed */
+	atomic64_t nsecs;         /* time spent compressing and inflating */
+};
+
+/*
+ * Deduplication state of a device, and how well it does.
+ */
+struct scull_dedup {
+	int on;                   /* look up the quanta as they fill up */
+	atomic_long_t hashed;     /* full quanta looked up */
+	atomic_long_t hits;       /* found identical to one already stored */
+	atomic_long_t zero;       /* found all zeroes, and dropped */
+	atomic_long_t cows;       /* shared quanta copied to be written */
+};
+
+/*
+ * Counters of what a device does. There is a copy per CPU, so that the
+ * I/O paths bump them without sharing a cache line; they are summed
+ * when somebody looks (see /sys/kernel/debug/scull).
+ */
+struct scull_stats {
+	u64 rd_bytes, rd_ops;     /* read, splice out */
+	u64 wr_bytes, wr_ops;     /* write, splice in */
+	u64 quanta_alloc, quanta_free;
+	u64 qsets_alloc, qsets_free;
+	u64 trims;
+	u64 alloc_fail;
 };
 
+#define scull_count(dev, field, n) this_cpu_add((dev)->stats->field, (n))
+
 struct scull_dev {
-	struct scull_qset *data;  /* Pointer to first quantum set */
+	struct scull_map *map;    /* the quantum sets */
 	int quantum;              /* the current quantum size */
 	int qset;                 /* the current array size */
+	int order;                /* page order of quanta, -1 for kmalloc */
 	unsigned long size;       /* amount of data stored here */
 	unsigned int access_key;  /* used by sculluid and scullpriv */
-	struct mutex lock;     /* mutual exclusion semaphore     */
+	atomic_t vmas;            /* active mappings */
+	atomic_long_t nquanta;    /* quanta allocated, used or not */
+	atomic_long_t nqsets;     /* quantum sets allocated */
+	char *small;              /* all the data, while the device is small */
+	struct scull_dev *origin; /* for a snapshot, the device it was taken of */
+	struct scull_zip zip;     /* compression of cold quanta */
+	struct scull_dedup dedup; /* sharing of identical quanta */
+	struct scull_stats __percpu *stats;
+	struct dentry *debugfs;   /* its file under scull/ in debugfs, if any */
+	int node;                 /* where quanta go: a node, or SCULL_NUMA_* */
+	int rotor;                /* the last node used when interleaving */
+	struct rw_semaphore sem;  /* shared by I/O, held alone to reshape */
 	struct cdev cdev;	  /* Char device structure		*/
 };
 
@@ -108,6 +239,10 @@ extern int scull_major;     /* main.c */
 extern int scull_nr_devs;
 extern int scull_quantum;
 extern int scull_qset;
+extern int scull_small;
+extern int scull_numa;
+extern int scull_zip_after;	/* compress.c */
+extern int scull_dedup;		/* dedup.c */
 
 extern int scull_p_buffer;	/* pipe.c */
 
@@ -120,14 +255,56 @@ int     scull_p_init(dev_t dev);
 void    scull_p_cleanup(void);
 int     scull_access_init(dev_t dev);
 void    scull_access_cleanup(void);
+int     scull_dyn_init(void);
+void    scull_dyn_cleanup(void);
+
+extern struct file_operations scull_fops;
 
+int     scull_dev_init(struct scull_dev *dev);
+void    scull_dev_setup(struct scull_dev *dev, int order, const char *name);
+void    scull_dev_cleanup(struct scull_dev *dev);
+void    scull_debugfs_add(struct scull_dev *dev, const char *name);
+void    scull_debugfs_remove(struct scull_dev *dev);
 int     scull_trim(struct scull_dev *dev);
+int     scull_node(struct scull_dev *dev, gfp_t *gfp);
+void   *scull_new_quantum(int quantum, int node, gfp_t gfp);
+void    scull_release_quantum(void *data, int quantum);
+void    scull_put_qset(struct scull_qset *dptr, int quantum, int qset);
+
+void    scull_z_setup(struct scull_dev *dev);
+int     scull_z_set(struct scull_dev *dev, unsigned int seconds);
+int     scull_z_inflate(struct scull_dev *dev, void *q, void *buf);
+int     scull_z_unpack(struct scull_dev *dev, void **slot, gfp_t gfp);
+void    scull_z_cleanup(void);
+
+void    scull_d_init(void);
+void    scull_d_setup(struct scull_dev *dev);
+void    scull_d_complete(struct scull_dev *dev, void **slot);
+int     scull_d_unshare(struct scull_dev *dev, void **slot, gfp_t gfp);
+void    scull_d_put(struct scull_shared *sh);
+int     scull_d_share(void **slot, void **copy, int quantum, gfp_t gfp);
 
-ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
-                   loff_t *f_pos);
-ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
-                    loff_t *f_pos);
+int     scull_b_save(struct scull_dev *dev, struct file *out);
+int     scull_b_load(struct scull_dev *dev, struct file *in);
+int     scull_b_ioctl(struct scull_dev *dev, unsigned int cmd, int fd);
+void    scull_b_load_all(struct scull_dev *devs, int nr);
+void    scull_b_save_all(struct scull_dev *devs, int nr);
+
+int     scull_snap_create(struct file *filp);
+struct scull_qset *scull_snap_clone(struct scull_dev *dev, unsigned long n,
+		struct scull_qset *old, gfp_t gfp);
+
+ssize_t scull_read_dev(struct scull_dev *dev, struct kiocb *iocb,
+		struct iov_iter *to);
+ssize_t scull_write_dev(struct scull_dev *dev, struct kiocb *iocb,
+		struct iov_iter *from);
+ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from);
+loff_t  scull_seek_hole_data(struct scull_dev *dev, loff_t off, int whence);
+ssize_t scull_splice_read(struct file *in, loff_t *ppos,
+		struct pipe_inode_info *pipe, size_t len, unsigned int flags);
 loff_t  scull_llseek(struct file *filp, loff_t off, int whence);
+int     scull_mmap(struct file *filp, struct vm_area_struct *vma);
 long     scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
 
 
@@ -169,8 +346,139 @@ long     scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
  */
 #define SCULL_P_IOCTSIZE _IO(SCULL_IOC_MAGIC,   13)
 #define SCULL_P_IOCQSIZE _IO(SCULL_IOC_MAGIC,   14)
+
+/*
+ * Commands acting on the contents of one bare device.
+ */
+struct scull_range {
+	__u64 offset;
+	__u64 length;
+};
+
+struct scull_usage {
+	__u64 size;      /* bytes of data, as seen by read() */
+	__u64 reserved;  /* bytes of quanta allocated, written or not */
+	__u64 footprint; /* kernel memory held, bookkeeping included */
+};
+
+struct scull_zstat {
+	__u64 raw;       /* bytes of the quanta held compressed */
+	__u64 packed;    /* bytes they take now */
+	__u64 saved;     /* raw - packed; raw / packed is the ratio */
+	__u64 nsecs;     /* time spent compressing and inflating */
+};
+
+struct scull_copy {
+	__s32 fd_in;     /* another scull device, open for reading */
+	__u32 pad;
+	__u64 off_in;    /* where to read there */
+	__u64 off_out;   /* where to write here */
+	__u64 length;    /* returns the bytes copied, like copy_file_range */
+};
+
+/*
+ * The header of a saved device (see backing.c), little-endian. The
+ * data follows at SCULL_IMAGE_DATA plus its offset in the device.
+ */
+struct scull_image {
+	__le32 magic;    /* SCULL_IMAGE_MAGIC */
+	__le32 version;
+	__le64 size;     /* of the device: the data may end before */
+};
+
+#define SCULL_IMAGE_MAGIC   0x6c756373 /* "scul" */
+#define SCULL_IMAGE_VERSION 1
+#define SCULL_IMAGE_DATA    4096
+
+struct scull_dstat {
+	__u64 hashed;    /* full quanta looked up */
+	__u64 hits;      /* of which shared with an identical one */
+	__u64 zero;      /* of which all zeroes, dropped to a hole */
+	__u64 cows;      /* shared quanta copied to be written */
+};
+
+#define SCULL_IOCPUNCH   _IOW(SCULL_IOC_MAGIC,  15, struct scull_range)
+#define SCULL_IOCRESERVE _IOW(SCULL_IOC_MAGIC,  16, struct scull_range)
+#define SCULL_IOCGUSAGE  _IOR(SCULL_IOC_MAGIC,  17, struct scull_usage)
+#define SCULL_IOCTZIP    _IO(SCULL_IOC_MAGIC,   18) /* idle seconds, 0 = off */
+#define SCULL_IOCGZIP    _IOR(SCULL_IOC_MAGIC,  19, struct scull_zstat)
+#define SCULL_IOCTDEDUP  _IO(SCULL_IOC_MAGIC,   20) /* 1 = on, 0 = off */
+#define SCULL_IOCGDEDUP  _IOR(SCULL_IOC_MAGIC,  21, struct scull_dstat)
+#define SCULL_IOCSNAP    _IO(SCULL_IOC_MAGIC,   22) /* returns a new fd */
+#define SCULL_IOCCOPY    _IOW(SCULL_IOC_MAGIC,  23, struct scull_copy)
+#define SCULL_IOCTNUMA   _IO(SCULL_IOC_MAGIC,   24) /* a node, or as below */
+#define SCULL_IOCGNUMA   _IOR(SCULL_IOC_MAGIC,  25, int)
+#define SCULL_IOCSAVE    _IO(SCULL_IOC_MAGIC,   26) /* to this fd */
+#define SCULL_IOCLOAD    _IO(SCULL_IOC_MAGIC,   27) /* from this fd */
+
+/*
+ * Commands of the control device, /dev/scullctl (dyn.c).
+ */
+#define SCULL_IOCCREATE  _IO(SCULL_IOC_MAGIC,   28) /* returns N: sculldN */
+#define SCULL_IOCDESTROY _IO(SCULL_IOC_MAGIC,   29) /* N */
+
+/*
+ * Commands of one scullpipe, unlike SCULL_P_IOCTSIZE.
+ */
+#define SCULL_P_IOCTRING _IO(SCULL_IOC_MAGIC,   30) /* new size, 0 = query */
+#define SCULL_P_IOCTGROW _IO(SCULL_IOC_MAGIC,   31) /* growth cap, 0 = off */
+#define SCULL_P_IOCWAKE  _IO(SCULL_IOC_MAGIC,   32) /* see struct scull_ring */
+#define SCULL_P_IOCTPACKET _IO(SCULL_IOC_MAGIC, 33) /* max record, 0 = off */
+#define SCULL_P_IOCRECV  _IOW(SCULL_IOC_MAGIC,  34, struct scull_recv)
 /* ... more to come */
 
-#define SCULL_IOC_MAXNR 14
+#define SCULL_IOC_MAXNR 34
+
+/*
+ * SCULL_P_IOCRECV takes records off a scullpipe in packet mode, as
+ * recvmmsg() does datagrams: it waits for the first one (unless the
+ * file is non-blocking), then takes those already there, up to "nr".
+ * Each lands in a buffer of its own, cut to "len" if longer, and "got"
+ * is set to its full length. Returns how many were taken.
+ */
+struct scull_rec {
+	__u64 buf;       /* user pointer */
+	__u32 len;       /* its size */
+	__u32 got;       /* returns the length of the record */
+};
+
+struct scull_recv {
+	__u64 recs;      /* user pointer to an array of struct scull_rec */
+	__u32 nr;        /* its length */
+	__u32 flags;     /* none yet: 0 */
+};
+
+/*
+ * The indices of a scullpipe, mapped at offset 0; the ring itself is
+ * at SCULL_RING_OFF_DATA. Byte "i" of the stream is at i & (size - 1)
+ * in the ring. The producer stores data, then head with release; the
+ * consumer loads head with acquire, reads, then stores tail with
+ * release. One side about to sleep in poll() sets its "waits" flag
+ * (the kernel does it too), and the other side, after moving its
+ * index and a full barrier, calls SCULL_P_IOCWAKE if it finds it set.
+ * A process takes the place of the reader or of the writer: it must
+ * not work on the same side as read() or write() calls.
+ *
+ * In packet mode ("packet" is then the largest record), each record
+ * is a __u32 length then the data, padded to SCULL_REC_SIZE(length);
+ * head and tail only ever point to the start of a record.
+ */
+struct scull_ring {
+	__u32 head;          /* bytes ever written */
+	__u32 reader_waits;  /* a consumer sleeps: wake it after head moves */
+	__u32 pad0[14];      /* head and tail on cache lines of their own */
+	__u32 tail;          /* bytes ever read */
+	__u32 writer_waits;  /* a producer sleeps: wake it after tail moves */
+	__u32 pad1[14];
+	__u32 size;          /* of the ring, a power of two */
+	__u32 packet;        /* largest record in packet mode, 0 = bytes */
+};
+
+#define SCULL_RING_OFF_DATA 0x10000000ULL
+#define SCULL_REC_SIZE(len) (4 + (((len) + 3) & ~3U)) /* in the ring */
+
+/* Placement of new quanta, besides binding them to a given node */
+#define SCULL_NUMA_LOCAL      (-1) /* on the writer's node (the default) */
+#define SCULL_NUMA_INTERLEAVE (-2) /* round robin over the online nodes */
 
 #endif /* _SCULL_H_ */
@@ -0,0 +1,176 @@
+/*
+ * scull_trace.h -- tracepoints for scull and scullpipe
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ */
+
+/*
+ * Unlike PDEBUG, these are always built in, and cost a patched-out
+ * branch until turned on, e.g.
+ *	echo 1 > /sys/kernel/tracing/events/scull/enable
+ * Devices are identified by number; snapshots have none, and show 0:0.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM scull
+
+#if !defined(_SCULL_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SCULL_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/types.h>
+#include <linux/kdev_t.h>
+#include <linux/timekeeping.h>	/* ktime_get_ns() */
+
+#ifndef scull_trace_start
+/*
+ * The events carry the time spent: the caller takes the clock on entry
+ * only when the event is on, and passes 0 otherwise.
+ */
+#define scull_trace_start(event) \
+	(trace_##event##_enabled() ? ktime_get_ns() : 0)
+#define scull_trace_ns(start) ((start) ? ktime_get_ns() - (start) : 0)
+#endif
+
+/* read, write and trim, on either kind of device */
+DECLARE_EVENT_CLASS(scull_io,
+
+	TP_PROTO(dev_t dev, loff_t pos, size_t count, ssize_t ret, u64 start),
+
+	TP_ARGS(dev, pos, count, ret, start),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(loff_t, pos)
+		__field(size_t, count)
+		__field(ssize_t, ret)
+		__field(u64, ns)
+	),
+
+	TP_fast_assign(
+		__entry->dev = dev;
+		__entry->pos = pos;
+		__entry->count = count;
+		__entry->ret = ret;
+		__entry->ns = scull_trace_ns(start);
+	),
+
+	TP_printk("dev %d:%d pos %lld count %zu ret %zd ns %llu",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->pos,
+		__entry->count, __entry->ret, __entry->ns)
+);
+
+DEFINE_EVENT(scull_io, scull_read,
+	TP_PROTO(dev_t dev, loff_t pos, size_t count, ssize_t ret, u64 start),
+	TP_ARGS(dev, pos, count, ret, start));
+
+DEFINE_EVENT(scull_io, scull_write,
+	TP_PROTO(dev_t dev, loff_t pos, size_t count, ssize_t ret, u64 start),
+	TP_ARGS(dev, pos, count, ret, start));
+
+/* "count" is the size that was dropped */
+DEFINE_EVENT(scull_io, scull_trim,
+	TP_PROTO(dev_t dev, loff_t pos, size_t count, ssize_t ret, u64 start),
+	TP_ARGS(dev, pos, count, ret, start));
+
+/* for the pipe, "pos" is where in the ring the data went or came from */
+DEFINE_EVENT(scull_io, scull_p_read,
+	TP_PROTO(dev_t dev, loff_t pos, size_t count, ssize_t ret, u64 start),
+	TP_ARGS(dev, pos, count, ret, start));
+
+DEFINE_EVENT(scull_io, scull_p_write,
+	TP_PROTO(dev_t dev, loff_t pos, size_t count, ssize_t ret, u64 start),
+	TP_ARGS(dev, pos, count, ret, start));
+
+/* "ret" is 1 if the item was created, 0 if found, or an error */
+TRACE_EVENT(scull_follow,
+
+	TP_PROTO(dev_t dev, unsigned long item, int ret, u64 start),
+
+	TP_ARGS(dev, item, ret, start),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, item)
+		__field(int, ret)
+		__field(u64, ns)
+	),
+
+	TP_fast_assign(
+		__entry->dev = dev;
+		__entry->item = item;
+		__entry->ret = ret;
+		__entry->ns = scull_trace_ns(start);
+	),
+
+	TP_printk("dev %d:%d item %lu ret %d ns %llu",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->item,
+		__entry->ret, __entry->ns)
+);
+
+/* a pipe reader waiting for data, or a writer waiting for room */
+TRACE_EVENT(scull_p_sleep,
+
+	TP_PROTO(dev_t dev, int writer),
+
+	TP_ARGS(dev, writer),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(int, writer)
+	),
+
+	TP_fast_assign(
+		__entry->dev = dev;
+		__entry->writer = writer;
+	),
+
+	TP_printk("dev %d:%d %s", MAJOR(__entry->dev), MINOR(__entry->dev),
+		__entry->writer ? "writer" : "reader")
+);
+
+/* ... and back, after "ns" asleep; "ret" is nonzero for a signal */
+TRACE_EVENT(scull_p_wakeup,
+
+	TP_PROTO(dev_t dev, int writer, int ret, u64 start),
+
+	TP_ARGS(dev, writer, ret, start),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(int, writer)
+		__field(int, ret)
+		__field(u64, ns)
+	),
+
+	TP_fast_assign(
+		__entry->dev = dev;
+		__entry->writer = writer;
+		__entry->ret = ret;
+		__entry->ns = scull_trace_ns(start);
+	),
+
+	TP_printk("dev %d:%d %s ret %d ns %llu",
+		MAJOR(__entry->dev), MINOR(__entry->dev),
+		__entry->writer ? "writer" : "reader", __entry->ret,
+		__entry->ns)
+);
+
+#endif /* _SCULL_TRACE_H */
+
+/* this part must be outside the protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE scull_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,210 @@
+/*
+ * snap.c -- copy-on-write snapshots of the bare scull devices
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ */
+
+#include <linux/module.h>
+
+#include <linux/kernel.h>	/* printk() */
+#include <linux/slab.h>		/* kmalloc() */
+#include <linux/fs.h>		/* everything... */
+#include <linux/errno.h>	/* error codes */
+#include <linux/types.h>
+#include <linux/fcntl.h>	/* O_RDONLY */
+#include <linux/file.h>		/* fd_install() */
+#include <linux/anon_inodes.h>
+#include <linux/cdev.h>
+#include <linux/xarray.h>
+#include <linux/refcount.h>
+
+#include "scull.h"		/* local definitions */
+
+/*
+ * A snapshot is a scull_dev of its own, reached through the file
+ * descriptor SCULL_IOCSNAP returns and gone when that is closed. Its
+ * map points to the very qsets of the device it was taken of, each
+ * with one more reference: taking it costs a pointer per qset. The
+ * device copies a qset before it changes it (scull_follow_write), and
+ * then the quanta are shared one by one, until written in turn.
+ *
+ * The snapshot holds a reference to a file of the device, which keeps
+ * the device around (devices made at run time are freed when the last
+ * file on them goes) and the module in.
+ */
+struct scull_snap {
+	struct scull_dev dev;
+	struct file *pin;         /* the file it was taken through */
+};
+
+/*
+ * Give "dev" a copy of its item "n", a qset still shared with a
+ * snapshot, and put the copy in the map. Called with the old qset
+ * locked for writing; returns the new one, locked the same way, or NULL
+ * with nothing changed but some quanta shared.
+ */
+struct scull_qset *scull_snap_clone(struct scull_dev *dev, unsigned long n,
+		struct scull_qset *old, gfp_t gfp)
+{
+	struct scull_qset *qs;
+	int i;
+
+	qs = kzalloc(sizeof(struct scull_qset), gfp);
+	if (!qs)
+		return NULL;
+	init_rwsem(&qs->sem);
+	refcount_set(&qs->ref, 1);
+	qs->atime = old->atime;
+	down_write(&qs->sem); /* nobody else can see it yet */
+
+	if (old->data) {
+		qs->data = kcalloc(dev->qset, sizeof(char *), gfp);
+		if (!qs->data)
+			goto fail;
+		for (i = 0; i < dev->qset; i++)
+			if (scull_d_share(&old->data[i], &qs->data[i],
+						dev->quantum, gfp))
+				goto fail;
+	}
+	if (xa_is_err(xa_store(&dev->map->qsets, n, qs, gfp)))
+		goto fail;
+
+	/* the snapshot keeps it alive until it takes our device's lock */
+	up_write(&old->sem);
+	scull_put_qset(old, dev->quantum, dev->qset);
+	return qs;
+
+  fail:
+	up_write(&qs->sem);
+	scull_put_qset(qs, dev->quantum, dev->qset);
+	return NULL;
+}
+
+/*
+ * Dropping the qsets waits for the device they were taken of to be
+ * idle: its readers and writers may still be on a qset it has just
+ * stopped sharing, which the snapshot alone keeps alive.
+ */
+static void scull_snap_free(struct scull_dev *snap)
+{
+	struct scull_snap *s = container_of(snap, struct scull_snap, dev);
+	struct scull_qset *dptr;
+	unsigned long item;
+
+	if (snap->origin) {
+		down_write(&snap->origin->sem);
+		xa_for_each(&snap->map->qsets, item, dptr)
+			scull_put_qset(dptr, snap->quantum, snap->qset);
+		xa_destroy(&snap->map->qsets);
+		up_write(&snap->origin->sem);
+	}
+	scull_dev_cleanup(snap);
+	if (s->pin)
+		fput(s->pin);
+	kfree(s);
+}
+
+static int scull_snap_release(struct inode *inode, struct file *filp)
+{
+	scull_snap_free(filp->private_data);
+	return 0;
+}
+
+static const struct file_operations scull_snap_fops = {
+	.owner =    THIS_MODULE,
+	.llseek =   scull_llseek,
+	.read_iter = scull_read_iter,
+	.splice_read = scull_splice_read,
+	.unlocked_ioctl = scull_ioctl,
+	.release =  scull_snap_release,
+};
+
+/*
+ * Take a snapshot of the device open as "filp" and return a read-only
+ * file descriptor for it. Mapped devices are refused: stores through
+ * the mapping would change the snapshot too. Snapshots of snapshots
+ * are no use, as these never change.
+ */
+int scull_snap_create(struct file *filp)
+{
+	struct scull_dev *dev = filp->private_data, *snap;
+	struct scull_qset *dptr;
+	struct scull_snap *s;
+	struct file *file;
+	unsigned long item;
+	int retval, fd;
+
+	if (dev->origin)
+		return -EINVAL;
+	s = kzalloc(sizeof(struct scull_snap), GFP_KERNEL);
+	if (!s)
+		return -ENOMEM;
+	snap = &s->dev;
+	retval = scull_dev_init(snap);
+	if (retval) {
+		kfree(s);
+		return retval;
+	}
+	s->pin = get_file(filp);
+
+	if (down_write_killable(&dev->sem)) {
+		retval = -ERESTARTSYS;
+		goto fail;
+	}
+	retval = -EBUSY;
+	if (atomic_read(&dev->vmas))
+		goto unlock;
+
+	snap->origin = dev;
+	snap->order = dev->order;
+	snap->quantum = dev->quantum;
+	snap->qset = dev->qset;
+	retval = -ENOMEM;
+	if (dev->small) {
+		snap->small = kmemdup(dev->small, dev->size, GFP_KERNEL);
+		if (!snap->small)
+			goto unlock;
+	}
+	xa_for_each(&dev->map->qsets, item, dptr) {
+		if (xa_is_err(xa_store(&snap->map->qsets, item, dptr,
+						GFP_KERNEL)))
+			goto unlock;
+		refcount_inc(&dptr->ref);
+		atomic_long_inc(&snap->nqsets);
+	}
+	atomic_long_set(&snap->nquanta, atomic_long_read(&dev->nquanta));
+	snap->size = dev->size;
+	up_write(&dev->sem);
+
+	fd = get_unused_fd_flags(O_CLOEXEC);
+	if (fd < 0) {
+		retval = fd;
+		goto fail;
+	}
+	file = anon_inode_getfile("[scull-snapshot]", &scull_snap_fops, snap,
+			O_RDONLY);
+	if (IS_ERR(file)) {
+		put_unused_fd(fd);
+		retval = PTR_ERR(file);
+		goto fail;
+	}
+	file->f_mode |= FMODE_LSEEK | FMODE_PREAD;
+	fd_install(fd, file);
+	return fd;
+
+  unlock:
+	up_write(&dev->sem);
+  fail:
+	scull_snap_free(snap);
+	return retval;
+}
@@ -0,0 +1,121 @@
+// Page mode against kmalloc'ed quanta: fill each device given, read it
+// back and trim it, and print the throughput of each step along with
+// the memory the device held. Load scull with some devices in page
+// mode to compare them, e.g.
+//   insmod scull.ko scull_order=-1,0,2
+//   scull_pages 256 /dev/scull0 /dev/scull1 /dev/scull2
+// for the kmalloc'ed 4000-byte quanta, single pages and order-2 pages.
+//
+// Usage: scull_pages megabytes device...
+// Build: gcc -O2 -o scull_pages scull_pages.c
+
+#include <fcntl.h>
+#include <linux/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+// from scull/scull.h, which is not fit for user space
+#define SCULL_IOC_MAGIC 'k'
+struct scull_usage {
+  __u64 size;
+  __u64 reserved;
+  __u64 footprint;
+};
+#define SCULL_IOCGUSAGE _IOR(SCULL_IOC_MAGIC, 17, struct scull_usage)
+
+#define BLOCK (64 * 1024)
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double mbs(size_t bytes, double start) {
+  return bytes / (now() - start) / (1 << 20);
+}
+
+static int bench(const char *path, size_t size, char *buf) {
+  struct scull_usage usage;
+  double start, write_mbs, read_mbs, trim_ms;
+  size_t done;
+  int fd;
+
+  // opening for writing only trims the device: start empty
+  fd = open(path, O_WRONLY | O_TRUNC);
+  if (fd < 0) {
+    perror(path);
+    return -1;
+  }
+  close(fd);
+
+  fd = open(path, O_RDWR);
+  if (fd < 0) {
+    perror(path);
+    return -1;
+  }
+
+  // every quantum is allocated here
+  start = now();
+  for (done = 0; done < size; done += BLOCK) {
+    // no two blocks alike, in case dedup is on
+    memcpy(buf, &done, sizeof(done));
+    if (pwrite(fd, buf, BLOCK, done) != BLOCK) goto fail;
+  }
+  write_mbs = mbs(size, start);
+
+  start = now();
+  for (done = 0; done < size; done += BLOCK)
+    if (pread(fd, buf, BLOCK, done) != BLOCK) goto fail;
+  read_mbs = mbs(size, start);
+
+  if (ioctl(fd, SCULL_IOCGUSAGE, &usage)) goto fail;
+  close(fd);
+
+  // and freed here, though partly on the scull_free workqueue
+  start = now();
+  fd = open(path, O_WRONLY | O_TRUNC);
+  if (fd < 0) {
+    perror(path);
+    return -1;
+  }
+  trim_ms = (now() - start) * 1000;
+  close(fd);
+
+  printf("%-14s %10.1f %10.1f %9.2f %10.1f%%\n", path, write_mbs, read_mbs,
+         trim_ms, 100.0 * (usage.footprint - usage.size) / usage.size);
+  return 0;
+
+fail:
+  perror(path);
+  close(fd);
+  return -1;
+}
+
+int main(int argc, char **argv) {
+  size_t size;
+  char *buf;
+  int i;
+
+  if (argc < 3 || (size = strtoul(argv[1], NULL, 0) << 20) < BLOCK) {
+    fprintf(stderr, "usage: %s megabytes device...\n", argv[0]);
+    return 1;
+  }
+  size -= size % BLOCK;
+  buf = malloc(BLOCK);
+  if (!buf) return 1;
+  for (i = 0; i < BLOCK; i++) buf[i] = rand();
+
+  printf("%zu MB in %d KB writes and reads\n", size >> 20, BLOCK >> 10);
+  printf("%-14s %10s %10s %9s %11s\n", "device", "write MB/s", "read MB/s",
+         "trim ms", "overhead");
+  for (i = 2; i < argc; i++)
+    if (bench(argv[i], size, buf)) return 1;
+  free(buf);
+  return 0;
+}
@@ -0,0 +1,149 @@
+// Read scaling of a bare scull device: N threads pread() the same data
+// for a while, for N = 1, 2, 4, ... up to a maximum, and the total
+// throughput is printed for each N. Readers only share the device
+// semaphore, so the throughput should grow with N up to the number of
+// CPUs.
+//
+// Usage: scull_readers [device [megabytes [max_threads [seconds]]]]
+//   e.g. scull_readers /dev/scull0 64 16 3
+// Build: gcc -O2 -pthread -o scull_readers scull_readers.c
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BLOCK (64 * 1024)
+
+static const char *path = "/dev/scull0";
+static size_t size = 64 << 20;
+static atomic_int stop;
+
+struct reader {
+  pthread_t thread;
+  int index;
+  unsigned long long bytes;
+};
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int fill_device(void) {
+  char *buf = malloc(BLOCK);
+  size_t done;
+  int fd;
+
+  if (!buf) return -1;
+  // opening for writing only trims the device
+  fd = open(path, O_WRONLY | O_TRUNC);
+  if (fd < 0) {
+    perror(path);
+    free(buf);
+    return -1;
+  }
+  for (done = 0; done < size; done += BLOCK) {
+    memset(buf, (int)(done / BLOCK), BLOCK);
+    if (write(fd, buf, BLOCK) != BLOCK) {
+      perror("write");
+      close(fd);
+      free(buf);
+      return -1;
+    }
+  }
+  close(fd);
+  free(buf);
+  return 0;
+}
+
+static void *read_loop(void *arg) {
+  struct reader *r = arg;
+  size_t blocks = size / BLOCK;
+  // start each reader elsewhere, so they do not walk in step
+  size_t block = r->index * blocks / 16;
+  char *buf = malloc(BLOCK);
+  ssize_t got;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0 || !buf) {
+    perror(path);
+    free(buf);
+    return NULL;
+  }
+  while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+    got = pread(fd, buf, BLOCK, (off_t)(block % blocks) * BLOCK);
+    if (got <= 0) {
+      if (got < 0 && errno == EINTR) continue;
+      perror("pread");
+      break;
+    }
+    r->bytes += got;
+    block++;
+  }
+  close(fd);
+  free(buf);
+  return NULL;
+}
+
+static double run(int nthreads, int seconds) {
+  struct reader *r = calloc(nthreads, sizeof(*r));
+  unsigned long long bytes = 0;
+  double start, elapsed;
+  int i;
+
+  if (!r) return 0;
+  atomic_store(&stop, 0);
+  start = now();
+  for (i = 0; i < nthreads; i++) {
+    r[i].index = i;
+    pthread_create(&r[i].thread, NULL, read_loop, &r[i]);
+  }
+  sleep(seconds);
+  atomic_store(&stop, 1);
+  for (i = 0; i < nthreads; i++) {
+    pthread_join(r[i].thread, NULL);
+    bytes += r[i].bytes;
+  }
+  elapsed = now() - start;
+  free(r);
+  return bytes / elapsed / (1 << 20);
+}
+
+int main(int argc, char **argv) {
+  int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int seconds = 3;
+  double one = 0, mbs;
+  int n;
+
+  if (argc > 1) path = argv[1];
+  if (argc > 2) size = strtoul(argv[2], NULL, 0) << 20;
+  if (argc > 3) max_threads = atoi(argv[3]);
+  if (argc > 4) seconds = atoi(argv[4]);
+  if (size < BLOCK || max_threads < 1 || seconds < 1) {
+    fprintf(stderr,
+            "usage: %s [device [megabytes [max_threads [seconds]]]]\n",
+            argv[0]);
+    return 1;
+  }
+
+  if (fill_device()) return 1;
+  printf("%s: %zu MB, %d KB reads, %d s per run\n", path, size >> 20,
+         BLOCK >> 10, seconds);
+  printf("%8s %12s %8s\n", "threads", "MB/s", "speedup");
+  for (n = 1;; n = n * 2 < max_threads ? n * 2 : max_threads) {
+    mbs = run(n, seconds);
+    if (n == 1) one = mbs;
+    printf("%8d %12.1f %8.2f\n", n, mbs, one ? mbs / one : 0);
+    if (n == max_threads) break;
+  }
+  return 0;
+}
@@ -0,0 +1,294 @@
+// Vectored and io_uring I/O on scull, without liburing.
+//
+// 1. pwritev() a few segments to a bare device and preadv() them back
+//    into differently cut ones: read_iter/write_iter take the whole
+//    iovec at once.
+// 2. preadv2(RWF_NOWAIT) on an empty scullpipe must fail with EAGAIN
+//    instead of sleeping; on the bare device it must simply work.
+// 3. io_uring reads and writes of the bare device, each run twice:
+//    once with IOSQE_ASYNC, which sends every request to a worker
+//    thread as io_uring had to before read_iter/write_iter, and once
+//    plain, where requests complete inline at submission.
+//
+// Usage: scull_uring [device [pipe [megabytes [block_kb [depth]]]]]
+//   e.g. scull_uring /dev/scull0 /dev/scullpipe0 64 4 32
+// Build: gcc -O2 -o scull_uring scull_uring.c
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *path = "/dev/scull0";
+static const char *pipe_path = "/dev/scullpipe0";
+static size_t size = 64 << 20;
+static size_t block = 4096;
+static unsigned depth = 32;
+
+struct ring {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+};
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int ring_init(struct ring *r, unsigned entries) {
+  struct io_uring_params p;
+  size_t sq_len, cq_len;
+  char *sq, *cq;
+
+  memset(&p, 0, sizeof(p));
+  r->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (r->fd < 0) {
+    perror("io_uring_setup");
+    return -1;
+  }
+  sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (cq_len > sq_len) sq_len = cq_len;
+    cq_len = sq_len;
+  }
+  sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            r->fd, IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED) goto fail;
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    cq = sq;
+  else
+    cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+  if (cq == MAP_FAILED) goto fail;
+  r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                 IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) goto fail;
+
+  r->sq_head = (unsigned *)(sq + p.sq_off.head);
+  r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)(sq + p.sq_off.array);
+  r->cq_head = (unsigned *)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return 0;
+
+fail:
+  perror("mmap io_uring");
+  close(r->fd);
+  return -1;
+}
+
+// Queue one request; the kernel sees it at the next io_uring_enter().
+static void ring_queue(struct ring *r, int op, int fd, void *buf,
+                       off_t off, unsigned char flags, unsigned long data) {
+  unsigned tail = *r->sq_tail;
+  unsigned idx = tail & *r->sq_mask;
+  struct io_uring_sqe *sqe = &r->sqes[idx];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = op;
+  sqe->flags = flags;
+  sqe->fd = fd;
+  sqe->addr = (unsigned long)buf;
+  sqe->len = block;
+  sqe->off = off;
+  sqe->user_data = data;
+  r->sq_array[idx] = idx;
+  atomic_store_explicit((_Atomic unsigned *)r->sq_tail, tail + 1,
+                        memory_order_release);
+}
+
+// Run passes over the device with up to depth requests in flight, and
+// return the MB/s, or a negative value on error.
+static double ring_run(int fd, int op, unsigned char flags, int passes) {
+  size_t blocks = size / block, total = blocks * passes;
+  size_t queued = 0, done = 0;
+  unsigned inflight = 0, to_submit, head, tail;
+  struct io_uring_cqe *cqe;
+  struct ring r;
+  double start;
+  char *bufs;
+  int ret;
+
+  if (ring_init(&r, depth)) return -1;
+  bufs = aligned_alloc(4096, depth * block);
+  if (!bufs) return -1;
+  memset(bufs, 0x5a, depth * block);
+
+  start = now();
+  while (done < total) {
+    to_submit = 0;
+    while (queued < total && inflight < depth) {
+      // a slot keeps the buffer of the request it last carried
+      unsigned slot = queued % depth;
+
+      ring_queue(&r, op, fd, bufs + slot * block,
+                 (off_t)(queued % blocks) * block, flags, slot);
+      queued++;
+      inflight++;
+      to_submit++;
+    }
+    ret = syscall(__NR_io_uring_enter, r.fd, to_submit, 1,
+                  IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      perror("io_uring_enter");
+      break;
+    }
+    head = *r.cq_head;
+    tail = atomic_load_explicit((_Atomic unsigned *)r.cq_tail,
+                                memory_order_acquire);
+    for (; head != tail; head++) {
+      cqe = &r.cqes[head & *r.cq_mask];
+      if (cqe->res != (int)block) {
+        fprintf(stderr, "request %llu: %s\n", cqe->user_data,
+                cqe->res < 0 ? strerror(-cqe->res) : "short");
+        done = total + 1;
+      }
+      done++;
+      inflight--;
+    }
+    atomic_store_explicit((_Atomic unsigned *)r.cq_head, head,
+                          memory_order_release);
+  }
+
+  close(r.fd);
+  free(bufs);
+  if (done != total) return -1;
+  return (double)total * block / (now() - start) / (1 << 20);
+}
+
+static int check_vectors(int fd) {
+  char a[100], b[3000], c[5000], x[7000], y[1], z[1099];
+  struct iovec out[3] = {{a, sizeof(a)}, {b, sizeof(b)}, {c, sizeof(c)}};
+  struct iovec in[3] = {{x, sizeof(x)}, {y, sizeof(y)}, {z, sizeof(z)}};
+  char all_out[8100], all_in[8100];
+
+  memset(a, 'a', sizeof(a));
+  memset(b, 'b', sizeof(b));
+  memset(c, 'c', sizeof(c));
+  if (pwritev(fd, out, 3, 0) != sizeof(all_out)) {
+    perror("pwritev");
+    return -1;
+  }
+  if (preadv(fd, in, 3, 0) != sizeof(all_in)) {
+    perror("preadv");
+    return -1;
+  }
+  memcpy(all_out, a, sizeof(a));
+  memcpy(all_out + sizeof(a), b, sizeof(b));
+  memcpy(all_out + sizeof(a) + sizeof(b), c, sizeof(c));
+  memcpy(all_in, x, sizeof(x));
+  memcpy(all_in + sizeof(x), y, sizeof(y));
+  memcpy(all_in + sizeof(x) + sizeof(y), z, sizeof(z));
+  if (memcmp(all_out, all_in, sizeof(all_out))) {
+    fprintf(stderr, "preadv: not what pwritev wrote\n");
+    return -1;
+  }
+  printf("pwritev/preadv: %zu bytes in 3 segments each, ok\n",
+         sizeof(all_out));
+  return 0;
+}
+
+static int check_nowait(int fd) {
+  char buf[64], msg[] = "scull";
+  struct iovec iov = {buf, sizeof(buf)};
+  struct iovec out = {msg, sizeof(msg)};
+  ssize_t got;
+  int pfd;
+
+  // an idle bare device never makes a nowait read wait
+  if (preadv2(fd, &iov, 1, 0, RWF_NOWAIT) < 0) {
+    perror("preadv2(RWF_NOWAIT) on the device");
+    return -1;
+  }
+
+  // a scullpipe opened for both sides, so that an empty pipe would block
+  pfd = open(pipe_path, O_RDWR);
+  if (pfd < 0) {
+    perror(pipe_path);
+    return -1;
+  }
+  while ((got = preadv2(pfd, &iov, 1, -1, RWF_NOWAIT)) > 0)
+    ;  // drain what an earlier run left
+  if (got == 0 || errno != EAGAIN) {
+    fprintf(stderr, "preadv2(RWF_NOWAIT) on an empty pipe: %s\n",
+            got ? strerror(errno) : "end of file");
+    close(pfd);
+    return -1;
+  }
+  if (pwritev2(pfd, &out, 1, -1, RWF_NOWAIT) != sizeof(msg) ||
+      preadv2(pfd, &iov, 1, -1, RWF_NOWAIT) != sizeof(msg) ||
+      memcmp(buf, msg, sizeof(msg))) {
+    perror("RWF_NOWAIT round trip on the pipe");
+    close(pfd);
+    return -1;
+  }
+  close(pfd);
+  printf("RWF_NOWAIT: EAGAIN on an empty pipe, data otherwise, ok\n");
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  static const struct {
+    const char *name;
+    int op;
+    unsigned char flags;
+  } runs[] = {
+      {"write, punted", IORING_OP_WRITE, IOSQE_ASYNC},
+      {"write, inline", IORING_OP_WRITE, 0},
+      {"read, punted", IORING_OP_READ, IOSQE_ASYNC},
+      {"read, inline", IORING_OP_READ, 0},
+  };
+  double mbs;
+  unsigned i;
+  int fd;
+
+  if (argc > 1) path = argv[1];
+  if (argc > 2) pipe_path = argv[2];
+  if (argc > 3) size = strtoul(argv[3], NULL, 0) << 20;
+  if (argc > 4) block = strtoul(argv[4], NULL, 0) << 10;
+  if (argc > 5) depth = strtoul(argv[5], NULL, 0);
+  if (!block || size < block || !depth) {
+    fprintf(stderr,
+            "usage: %s [device [pipe [megabytes [block_kb [depth]]]]]\n",
+            argv[0]);
+    return 1;
+  }
+
+  fd = open(path, O_RDWR | O_TRUNC);
+  if (fd < 0) {
+    perror(path);
+    return 1;
+  }
+  if (check_vectors(fd) || check_nowait(fd)) return 1;
+
+  printf("%s: %zu MB, %zu KB requests, %u in flight\n", path, size >> 20,
+         block >> 10, depth);
+  for (i = 0; i < sizeof(runs) / sizeof(runs[0]); i++) {
+    mbs = ring_run(fd, runs[i].op, runs[i].flags, 4);
+    if (mbs < 0) return 1;
+    printf("%-16s %10.1f MB/s %12.0f ops/s\n", runs[i].name, mbs,
+           mbs * (1 << 20) / block);
+  }
+  close(fd);
+  return 0;
+}